@@ -0,0 +1,89 @@
+#include "bench.h"
+
+#include <gtk/gtk.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+
+gboolean bench_enabled;
+
+static int frames_wanted;
+static int frames;
+static gint64 start_time;
+static struct rusage start_usage;
+static GArray *latencies;
+
+static int
+compare_latencies (const void *a, const void *b)
+{
+  gint64 la = *(const gint64 *) a, lb = *(const gint64 *) b;
+
+  return la < lb ? -1 : la > lb;
+}
+
+static double
+timeval_diff (struct timeval *end, struct timeval *start)
+{
+  return (end->tv_sec - start->tv_sec) +
+    (end->tv_usec - start->tv_usec) / (double) G_USEC_PER_SEC;
+}
+
+/* Printed on stdout in a form that is easy to grep from scripts */
+static void
+bench_report (void)
+{
+  struct rusage usage;
+  double elapsed, user, sys;
+  gint64 *samples = (gint64 *) latencies->data;
+  guint n = latencies->len;
+
+  getrusage (RUSAGE_SELF, &usage);
+  elapsed = (g_get_monotonic_time () - start_time) / (double) G_USEC_PER_SEC;
+  user = timeval_diff (&usage.ru_utime, &start_usage.ru_utime);
+  sys = timeval_diff (&usage.ru_stime, &start_usage.ru_stime);
+
+  qsort (samples, n, sizeof (gint64), compare_latencies);
+
+  printf ("bench: frames: %d\n", frames);
+  printf ("bench: elapsed: %.3f s\n", elapsed);
+  printf ("bench: fps: %.2f\n", frames / elapsed);
+  printf ("bench: latency p50: %.3f ms\n", samples[n * 50 / 100] / 1000.0);
+  printf ("bench: latency p95: %.3f ms\n", samples[n * 95 / 100] / 1000.0);
+  printf ("bench: latency p99: %.3f ms\n", samples[n * 99 / 100] / 1000.0);
+  printf ("bench: cpu user: %.3f s\n", user);
+  printf ("bench: cpu sys: %.3f s\n", sys);
+  printf ("bench: cpu per frame: %.3f ms\n", (user + sys) * 1000.0 / frames);
+  fflush (stdout);
+}
+
+void
+bench_frame (gint64 latency)
+{
+  /* time starts with the first frame, after clients have started */
+  if (frames == 0) {
+    start_time = g_get_monotonic_time ();
+    getrusage (RUSAGE_SELF, &start_usage);
+  } else {
+    g_array_append_val (latencies, latency);
+  }
+
+  if (++frames < frames_wanted)
+    return;
+
+  frames--;
+  bench_report ();
+  bench_enabled = FALSE;
+  gtk_main_quit ();
+}
+
+void
+bench_init (int n_frames)
+{
+  if (n_frames < 1)
+    return;
+
+  /* the first frame only starts the clock */
+  frames_wanted = n_frames + 1;
+  latencies = g_array_sized_new (FALSE, FALSE, sizeof (gint64), n_frames);
+  bench_enabled = TRUE;
+}
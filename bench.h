@@ -0,0 +1,18 @@
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include <glib.h>
+
+/* Set by bench_init (), the compositor only feeds the benchmark when
+   it is running */
+extern gboolean bench_enabled;
+
+/* Runs the benchmark for n_frames frames painted with client contents,
+   then reports and quits the main loop */
+void bench_init    (int n_frames);
+
+/* A frame with new client contents was painted, latency being the time
+   from the oldest commit it shows to the end of the paint */
+void bench_frame   (gint64 latency);
+
+#endif
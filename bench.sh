@@ -0,0 +1,56 @@
+#!/bin/sh
+#
+# Runs the nested compositor against a headless weston with Mesa
+# software rendering, so that it can be benchmarked without a GPU or a
+# desktop session.
+#
+#   FRAMES       frames of client contents to measure (600)
+#   CLIENTS      number of nested clients (1)
+#   CLIENT_ARGS  load mode of the clients, see ./client --help
+#   SERVER_ARGS  extra arguments for the server
+#   WESTON_ARGS  arguments for weston, for the backend and renderer
+#
+# NESTED_* environment variables are passed on to the server.
+
+FRAMES=${FRAMES:-600}
+CLIENTS=${CLIENTS:-1}
+WESTON_ARGS=${WESTON_ARGS:---backend=headless --renderer=gl --width=1024 --height=768}
+
+cd "$(dirname "$0")" || exit 1
+
+if ! command -v weston >/dev/null 2>&1; then
+  echo "bench: weston is needed for the headless parent compositor" >&2
+  exit 1
+fi
+
+if [ -z "$XDG_RUNTIME_DIR" ]; then
+  XDG_RUNTIME_DIR=$(mktemp -d)
+  export XDG_RUNTIME_DIR
+fi
+
+export LIBGL_ALWAYS_SOFTWARE=1
+export GDK_BACKEND=wayland
+
+SOCKET=nested-bench-$$
+LOG=$(mktemp)
+
+weston $WESTON_ARGS --socket="$SOCKET" --idle-time=0 >"$LOG" 2>&1 &
+WESTON_PID=$!
+trap 'kill $WESTON_PID 2>/dev/null; rm -f "$LOG"' EXIT INT TERM
+
+i=0
+while [ ! -S "$XDG_RUNTIME_DIR/$SOCKET" ]; do
+  i=$((i + 1))
+  if [ $i -gt 50 ] || ! kill -0 $WESTON_PID 2>/dev/null; then
+    echo "bench: weston failed to start:" >&2
+    cat "$LOG" >&2
+    exit 1
+  fi
+  sleep 0.1
+done
+
+echo "bench: $CLIENTS client(s) ${CLIENT_ARGS:+($CLIENT_ARGS) }$FRAMES frames"
+
+WAYLAND_DISPLAY=$SOCKET NESTED_LOG_LEVEL=${NESTED_LOG_LEVEL:-warning} \
+  ./server --clients "$CLIENTS" --frames "$FRAMES" \
+    --client-args "$CLIENT_ARGS" $SERVER_ARGS
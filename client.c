@@ -20,19 +20,73 @@
  * OF THIS SOFTWARE.
  */
 
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <wayland-egl.h>
 #include <wayland-cursor.h>
 
 #include <GLES2/gl2.h>
 #include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+#include "os-compatibility.h"
+
+#define MAX_WIDTH 3840
+#define MAX_HEIGHT 2160
+#define MAX_BUFFERS 4
+
+/* side of the square updated with partial damage */
+#define DAMAGE_SIZE 64
+
+/* older EGL back buffers are redrawn whole */
+#define MAX_BUFFER_AGE 4
+
+#define STATS_INTERVAL_US 5000000
 
 struct window;
 struct seat;
 
+/* Synthetic load, from the command line */
+struct options {
+  int width, height;
+  int shm;
+  int partial_damage;
+  int n_buffers;
+  int resize_storm;
+  int ignore_frame_callbacks;
+  int frames;
+  int pooled_fd;
+};
+
+struct shm_buffer {
+  struct wl_buffer *buffer;
+  void *data;
+  size_t size;
+  int width, height;
+  int busy;
+  /* frame last drawn into the buffer, -1 while it has never been */
+  int frame;
+};
+
+struct frame_stats {
+  uint64_t start;
+  uint64_t last_frame;
+  uint64_t last_report;
+  int frames;
+  int report_frames;
+  uint64_t max_interval;
+  int buffer_waits;
+};
+
 struct nested_client {
   struct wl_display *display;
   struct wl_registry *registry;
@@ -53,6 +107,17 @@ struct nested_client {
   struct wl_surface *surface;
   struct wl_egl_window *native;
   int width, height;
+
+  struct options opts;
+  PFNEGLSWAPBUFFERSWITHDAMAGEEXTPROC swap_buffers_with_damage;
+  int has_buffer_age;
+
+  struct wl_shm *shm;
+  struct shm_buffer buffers[MAX_BUFFERS];
+
+  int frame;
+  int running;
+  struct frame_stats stats;
 };
 
 #define POS 0
@@ -185,6 +250,314 @@ render_triangle(struct nested_client *client, uint32_t time)
   glFlush();
 }
 
+static uint64_t
+get_time_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+print_stats(struct nested_client *client, uint64_t now, const char *when)
+{
+  struct frame_stats *stats = &client->stats;
+  uint64_t elapsed = now - stats->last_report;
+
+  printf("client %d: %s: frames: %d, fps: %.2f, max frame interval: %.3f ms, "
+         "buffer waits: %d\n",
+         getpid(), when, stats->report_frames,
+         elapsed ? stats->report_frames * 1000000.0 / elapsed : 0.0,
+         stats->max_interval / 1000.0, stats->buffer_waits);
+  fflush(stdout);
+
+  stats->last_report = now;
+  stats->report_frames = 0;
+  stats->max_interval = 0;
+  stats->buffer_waits = 0;
+}
+
+static void
+update_stats(struct nested_client *client)
+{
+  struct frame_stats *stats = &client->stats;
+  uint64_t now = get_time_us();
+
+  if (stats->frames == 0) {
+    stats->start = now;
+    stats->last_report = now;
+  } else if (now - stats->last_frame > stats->max_interval) {
+    stats->max_interval = now - stats->last_frame;
+  }
+
+  stats->last_frame = now;
+  stats->frames++;
+  stats->report_frames++;
+
+  if (now - stats->last_report >= STATS_INTERVAL_US)
+    print_stats(client, now, "running");
+
+  if (client->opts.frames && stats->frames >= client->opts.frames)
+    client->running = 0;
+}
+
+/* Square moved around the surface by partial damage updates */
+static void
+get_damage_rect(struct nested_client *client, int frame,
+                int *x, int *y, int *w, int *h)
+{
+  *w = DAMAGE_SIZE < client->width ? DAMAGE_SIZE : client->width;
+  *h = DAMAGE_SIZE < client->height ? DAMAGE_SIZE : client->height;
+  *x = client->width > *w ? (frame * 8) % (client->width - *w) : 0;
+  *y = client->height > *h ? (frame * 4) % (client->height - *h) : 0;
+}
+
+/* A buffer still holds the frame drawn into it age frames ago, so the
+   squares of the frames since then are redrawn too. Buffers of unknown
+   age, 0, are redrawn whole. Returns the age, 0 when redrawn whole */
+static int
+get_aged_damage_rect(struct nested_client *client, int age,
+                     int *x, int *y, int *w, int *h)
+{
+  int i, x1, y1, x2, y2;
+
+  if (age < 1 || age > MAX_BUFFER_AGE || age > client->frame) {
+    *x = *y = 0;
+    *w = client->width;
+    *h = client->height;
+    return 0;
+  }
+
+  get_damage_rect(client, client->frame, x, y, w, h);
+  x1 = *x;
+  y1 = *y;
+  x2 = *x + *w;
+  y2 = *y + *h;
+  for (i = 1; i < age; i++) {
+    get_damage_rect(client, client->frame - i, x, y, w, h);
+    x1 = *x < x1 ? *x : x1;
+    y1 = *y < y1 ? *y : y1;
+    x2 = *x + *w > x2 ? *x + *w : x2;
+    y2 = *y + *h > y2 ? *y + *h : y2;
+  }
+
+  *x = x1;
+  *y = y1;
+  *w = x2 - x1;
+  *h = y2 - y1;
+
+  return age;
+}
+
+static void
+get_egl_damage_rect(struct nested_client *client,
+                    int *x, int *y, int *w, int *h)
+{
+  EGLint age = 0;
+
+  if (client->has_buffer_age)
+    eglQuerySurface(client->egl_display, client->egl_surface,
+                    EGL_BUFFER_AGE_EXT, &age);
+
+  get_aged_damage_rect(client, age, x, y, w, h);
+}
+
+/* Resize storms cycle through sizes below the requested one, changing
+   every frame */
+static void
+update_size(struct nested_client *client)
+{
+  static const int quarters[4][2] = {
+    { 4, 4 }, { 3, 3 }, { 2, 2 }, { 3, 4 }
+  };
+  int i = client->frame % 4;
+
+  client->width = client->opts.width * quarters[i][0] / 4;
+  client->height = client->opts.height * quarters[i][1] / 4;
+
+  if (client->native)
+    wl_egl_window_resize(client->native,
+                         client->width, client->height, 0, 0);
+}
+
+static void
+buffer_release(void *data, struct wl_buffer *buffer)
+{
+  struct shm_buffer *shm_buffer = data;
+
+  shm_buffer->busy = 0;
+}
+
+static const struct wl_buffer_listener buffer_listener = {
+  buffer_release
+};
+
+static void
+shm_buffer_destroy(struct shm_buffer *buffer)
+{
+  wl_buffer_destroy(buffer->buffer);
+  munmap(buffer->data, buffer->size);
+  memset(buffer, 0, sizeof *buffer);
+}
+
+static int
+shm_buffer_create(struct nested_client *client, struct shm_buffer *buffer)
+{
+  struct wl_shm_pool *pool;
+  int stride = client->width * 4;
+  int fd;
+
+  buffer->size = stride * client->height;
+  fd = os_create_anonymous_file(buffer->size);
+  if (fd < 0) {
+    fprintf(stderr, "Error: creating a buffer file for %zu B: %s\n",
+            buffer->size, strerror(errno));
+    return -1;
+  }
+
+  buffer->data = mmap(NULL, buffer->size,
+                      PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (buffer->data == MAP_FAILED) {
+    fprintf(stderr, "Error: mmap failed: %s\n", strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  pool = wl_shm_create_pool(client->shm, fd, buffer->size);
+  buffer->buffer = wl_shm_pool_create_buffer(pool, 0,
+                                             client->width, client->height,
+                                             stride, WL_SHM_FORMAT_XRGB8888);
+  wl_buffer_add_listener(buffer->buffer, &buffer_listener, buffer);
+  wl_shm_pool_destroy(pool);
+  close(fd);
+
+  buffer->width = client->width;
+  buffer->height = client->height;
+  buffer->frame = -1;
+
+  /* new buffers are filled whole, partial updates only touch a part */
+  memset(buffer->data, 0x66, buffer->size);
+
+  return 0;
+}
+
+/* Free buffer of the current size, or NULL if they are all busy */
+static struct shm_buffer *
+next_shm_buffer(struct nested_client *client)
+{
+  struct shm_buffer *buffer;
+  int i;
+
+  for (i = 0; i < client->opts.n_buffers; i++) {
+    buffer = &client->buffers[i];
+    if (buffer->busy)
+      continue;
+
+    if (buffer->buffer && (buffer->width != client->width ||
+                           buffer->height != client->height))
+      shm_buffer_destroy(buffer);
+
+    if (!buffer->buffer && shm_buffer_create(client, buffer) < 0)
+      exit(1);
+
+    return buffer;
+  }
+
+  return NULL;
+}
+
+static void
+fill_rect(struct shm_buffer *buffer, int x, int y, int w, int h,
+          uint32_t color)
+{
+  uint32_t *row;
+  int i, j;
+
+  for (j = y; j < y + h; j++) {
+    row = (uint32_t *) buffer->data + j * buffer->width;
+    for (i = x; i < x + w; i++)
+      row[i] = color;
+  }
+}
+
+static uint32_t
+frame_color(int frame)
+{
+  return 0xff000000 | ((frame * 0x010203) & 0xffffff);
+}
+
+static void
+redraw_shm(struct nested_client *client)
+{
+  struct shm_buffer *buffer;
+  int x, y, w, h, sx, sy, sw, sh;
+  int i, age = 0;
+
+  while (!(buffer = next_shm_buffer(client))) {
+    client->stats.buffer_waits++;
+    if (wl_display_dispatch(client->display) < 0)
+      exit(1);
+  }
+
+  if (client->opts.partial_damage) {
+    age = get_aged_damage_rect(client,
+                               buffer->frame < 0 ?
+                               0 : client->frame - buffer->frame,
+                               &x, &y, &w, &h);
+  } else {
+    x = y = 0;
+    w = client->width;
+    h = client->height;
+  }
+
+  /* the squares of the frames the buffer missed, oldest first */
+  if (age == 0)
+    fill_rect(buffer, x, y, w, h, frame_color(client->frame));
+  for (i = age - 1; i >= 0; i--) {
+    get_damage_rect(client, client->frame - i, &sx, &sy, &sw, &sh);
+    fill_rect(buffer, sx, sy, sw, sh, frame_color(client->frame - i));
+  }
+
+  wl_surface_attach(client->surface, buffer->buffer, 0, 0);
+  wl_surface_damage(client->surface, x, y, w, h);
+  wl_surface_commit(client->surface);
+  buffer->busy = 1;
+  buffer->frame = client->frame;
+}
+
+static void
+redraw_egl(struct nested_client *client, uint32_t time)
+{
+  EGLint rect[4];
+  int x, y, w, h;
+
+  if (!client->opts.partial_damage) {
+    render_triangle(client, time);
+    eglSwapBuffers(client->egl_display, client->egl_surface);
+    return;
+  }
+
+  /* the rest of the back buffer is left as it is, what matters here is
+     the damage the compositor gets */
+  get_egl_damage_rect(client, &x, &y, &w, &h);
+  glEnable(GL_SCISSOR_TEST);
+  glScissor(x, client->height - y - h, w, h);
+  render_triangle(client, time);
+  glDisable(GL_SCISSOR_TEST);
+
+  if (client->swap_buffers_with_damage) {
+    rect[0] = x;
+    rect[1] = client->height - y - h;
+    rect[2] = w;
+    rect[3] = h;
+    client->swap_buffers_with_damage(client->egl_display,
+                                     client->egl_surface, rect, 1);
+  } else {
+    eglSwapBuffers(client->egl_display, client->egl_surface);
+  }
+}
+
 static void
 frame_callback(void *data, struct wl_callback *callback, uint32_t time);
 
@@ -192,6 +565,28 @@ static const struct wl_callback_listener frame_listener = {
   frame_callback
 };
 
+static void
+redraw(struct nested_client *client, uint32_t time)
+{
+  struct wl_callback *callback;
+
+  if (client->opts.resize_storm)
+    update_size(client);
+
+  if (!client->opts.ignore_frame_callbacks) {
+    callback = wl_surface_frame(client->surface);
+    wl_callback_add_listener(callback, &frame_listener, client);
+  }
+
+  if (client->opts.shm)
+    redraw_shm(client);
+  else
+    redraw_egl(client, time);
+
+  client->frame++;
+  update_stats(client);
+}
+
 static void
 frame_callback(void *data, struct wl_callback *callback, uint32_t time)
 {
@@ -201,12 +596,8 @@ frame_callback(void *data, struct wl_callback *callback, uint32_t time)
   if (callback)
     wl_callback_destroy(callback);
 
-  callback = wl_surface_frame(client->surface);
-  wl_callback_add_listener(callback, &frame_listener, client);
-
-  render_triangle(client, time);
-
-  eglSwapBuffers(client->egl_display, client->egl_surface);
+  if (client->running)
+    redraw(client, time);
   //  printf ("client: frame_callback end\n");
 }
 
@@ -220,6 +611,10 @@ registry_handle_global(void *data, struct wl_registry *registry,
     client->compositor =
       wl_registry_bind(registry, name,
                        &wl_compositor_interface, 1);
+  } else if (strcmp(interface, "wl_shm") == 0) {
+    client->shm =
+      wl_registry_bind(registry, name,
+                       &wl_shm_interface, 1);
   }
 }
 
@@ -234,8 +629,28 @@ static const struct wl_registry_listener registry_listener = {
   registry_handle_global_remove
 };
 
+/* Started ahead of time by the server, which writes a byte to the
+   control socket once we are to show up */
+static int
+wait_for_launch(const struct options *opts)
+{
+  char c;
+  ssize_t len;
+
+  if (opts->pooled_fd < 0)
+    return 0;
+
+  do
+    len = read(opts->pooled_fd, &c, 1);
+  while (len < 0 && errno == EINTR);
+
+  close(opts->pooled_fd);
+
+  return len == 1 ? 0 : -1;
+}
+
 static struct nested_client *
-nested_client_create(int width, int height)
+nested_client_create(const struct options *opts)
 {
   static const EGLint context_attribs[] = {
     EGL_CONTEXT_CLIENT_VERSION, 2,
@@ -254,15 +669,18 @@ nested_client_create(int width, int height)
 
   EGLint major, minor, n;
   EGLBoolean ret;
+  const char *extensions;
 
   struct nested_client *client;
 
-  client = malloc(sizeof *client);
+  client = calloc(1, sizeof *client);
   if (client == NULL)
     return NULL;
 
-  client->width  = width;
-  client->height = height;
+  client->opts = *opts;
+  client->width  = opts->width;
+  client->height = opts->height;
+  client->running = 1;
 
   client->display = wl_display_connect(NULL);
 
@@ -273,6 +691,20 @@ nested_client_create(int width, int height)
   /* get globals */
   wl_display_roundtrip(client->display);
 
+  if (opts->shm) {
+    if (!client->shm) {
+      fprintf(stderr, "Error: no wl_shm\n");
+      return NULL;
+    }
+
+    if (wait_for_launch(opts) < 0)
+      return NULL;
+
+    client->surface = wl_compositor_create_surface(client->compositor);
+    frame_callback(client, NULL, 0);
+    return client;
+  }
+
   client->egl_display = eglGetDisplay(client->display);
   if (client->egl_display == NULL)
     return NULL;
@@ -296,6 +728,9 @@ nested_client_create(int width, int height)
   if (!client->egl_context)
     return NULL;
 
+  if (wait_for_launch(opts) < 0)
+    return NULL;
+
   client->surface = wl_compositor_create_surface(client->compositor);
 
   client->native = wl_egl_window_create(client->surface,
@@ -313,6 +748,19 @@ nested_client_create(int width, int height)
   wl_egl_window_resize(client->native,
                        client->width, client->height, 0, 0);
 
+  extensions = eglQueryString(client->egl_display, EGL_EXTENSIONS);
+  if (strstr(extensions, "EGL_KHR_swap_buffers_with_damage"))
+    client->swap_buffers_with_damage =
+      (void *) eglGetProcAddress("eglSwapBuffersWithDamageKHR");
+  else if (strstr(extensions, "EGL_EXT_swap_buffers_with_damage"))
+    client->swap_buffers_with_damage =
+      (void *) eglGetProcAddress("eglSwapBuffersWithDamageEXT");
+  client->has_buffer_age = strstr(extensions, "EGL_EXT_buffer_age") != NULL;
+
+  /* flooding commits means not waiting for frame callbacks in swaps */
+  if (opts->ignore_frame_callbacks)
+    eglSwapInterval(client->egl_display, 0);
+
   frame_callback(client, NULL, 0);
 
   return client;
@@ -321,11 +769,21 @@ nested_client_create(int width, int height)
 static void
 nested_client_destroy(struct nested_client *client)
 {
-  eglMakeCurrent(client->egl_display,
-                 EGL_NO_SURFACE, EGL_NO_SURFACE,
-                 EGL_NO_CONTEXT);
+  int i;
 
-  wl_egl_window_destroy(client->native);
+  if (client->native) {
+    eglMakeCurrent(client->egl_display,
+                   EGL_NO_SURFACE, EGL_NO_SURFACE,
+                   EGL_NO_CONTEXT);
+
+    wl_egl_window_destroy(client->native);
+  }
+
+  for (i = 0; i < MAX_BUFFERS; i++)
+    if (client->buffers[i].buffer)
+      shm_buffer_destroy(&client->buffers[i]);
+  if (client->shm)
+    wl_shm_destroy(client->shm);
 
   wl_surface_destroy(client->surface);
 
@@ -337,11 +795,110 @@ nested_client_destroy(struct nested_client *client)
   wl_display_disconnect(client->display);
 }
 
+static void
+usage(const char *name)
+{
+  fprintf(stderr,
+          "usage: %s [options]\n"
+          "  -w, --width=W            surface width, up to %d (400)\n"
+          "  -h, --height=H           surface height, up to %d (300)\n"
+          "  -s, --shm                draw into wl_shm buffers instead of EGL\n"
+          "  -d, --damage=full|partial  redraw everything or a %dx%d square\n"
+          "  -b, --buffers=N          wl_shm buffers to cycle through, up to %d (2)\n"
+          "  -r, --resize-storm       change the surface size every frame\n"
+          "  -f, --flood              commit without waiting for frame callbacks\n"
+          "  -n, --frames=N           exit after N frames\n"
+          "  -p, --pooled=FD          wait for the server on FD before showing up\n"
+          "      --help               show this help\n",
+          name, MAX_WIDTH, MAX_HEIGHT, DAMAGE_SIZE, DAMAGE_SIZE, MAX_BUFFERS);
+}
+
+static int
+parse_options(int argc, char **argv, struct options *opts)
+{
+  static const struct option long_options[] = {
+    { "width", required_argument, NULL, 'w' },
+    { "height", required_argument, NULL, 'h' },
+    { "shm", no_argument, NULL, 's' },
+    { "damage", required_argument, NULL, 'd' },
+    { "buffers", required_argument, NULL, 'b' },
+    { "resize-storm", no_argument, NULL, 'r' },
+    { "flood", no_argument, NULL, 'f' },
+    { "frames", required_argument, NULL, 'n' },
+    { "pooled", required_argument, NULL, 'p' },
+    { "help", no_argument, NULL, 'H' },
+    { NULL, 0, NULL, 0 }
+  };
+  int c;
+
+  opts->width = 400;
+  opts->height = 300;
+  opts->n_buffers = 2;
+  opts->pooled_fd = -1;
+
+  while ((c = getopt_long(argc, argv, "w:h:sd:b:rfn:p:",
+                          long_options, NULL)) != -1) {
+    switch (c) {
+    case 'w':
+      opts->width = atoi(optarg);
+      break;
+    case 'h':
+      opts->height = atoi(optarg);
+      break;
+    case 's':
+      opts->shm = 1;
+      break;
+    case 'd':
+      if (strcmp(optarg, "partial") == 0)
+        opts->partial_damage = 1;
+      else if (strcmp(optarg, "full") != 0)
+        return -1;
+      break;
+    case 'b':
+      opts->n_buffers = atoi(optarg);
+      break;
+    case 'r':
+      opts->resize_storm = 1;
+      break;
+    case 'f':
+      opts->ignore_frame_callbacks = 1;
+      break;
+    case 'n':
+      opts->frames = atoi(optarg);
+      break;
+    case 'p':
+      opts->pooled_fd = atoi(optarg);
+      break;
+    case 'H':
+      return 1;
+    default:
+      return -1;
+    }
+  }
+
+  if (opts->width < 1 || opts->width > MAX_WIDTH ||
+      opts->height < 1 || opts->height > MAX_HEIGHT ||
+      opts->n_buffers < 1 || opts->n_buffers > MAX_BUFFERS ||
+      opts->frames < 0)
+    return -1;
+
+  return 0;
+}
+
 int
 main(int argc, char **argv)
 {
   struct nested_client *client;
-  int ret = 0;
+  struct options opts = { 0 };
+  char mode[32];
+  uint64_t elapsed;
+  int ret;
+
+  ret = parse_options(argc, argv, &opts);
+  if (ret != 0) {
+    usage(argv[0]);
+    return ret < 0 ? -1 : 0;
+  }
 
   if (getenv("WAYLAND_SOCKET") == NULL) {
     fprintf(stderr, "must be run by nested, don't run standalone\n");
@@ -350,12 +907,44 @@ main(int argc, char **argv)
 
   //  printf ("client: program started\n");
 
-  client = nested_client_create(400, 300);
+  if (opts.shm)
+    snprintf(mode, sizeof mode, "%d wl_shm buffers", opts.n_buffers);
+  else
+    snprintf(mode, sizeof mode, "EGL");
+
+  printf("client %d: %dx%d, %s, %s damage%s%s\n", getpid(),
+         opts.width, opts.height, mode,
+         opts.partial_damage ? "partial" : "full",
+         opts.resize_storm ? ", resize storm" : "",
+         opts.ignore_frame_callbacks ? ", flooding commits" : "");
 
-  while (ret != -1) {
-    ret = wl_display_dispatch(client->display);
+  client = nested_client_create(&opts);
+  if (!client) {
+    fprintf(stderr, "Error: failed to create the client\n");
+    return -1;
+  }
+
+  while (ret != -1 && client->running) {
+    if (opts.ignore_frame_callbacks) {
+      /* keep committing, only handling what the server already sent */
+      ret = wl_display_dispatch_pending(client->display);
+      if (ret != -1) {
+        redraw(client, 0);
+        if (wl_display_flush(client->display) < 0 && errno != EAGAIN)
+          ret = -1;
+      }
+    } else {
+      ret = wl_display_dispatch(client->display);
+    }
   }
 
+  print_stats(client, get_time_us(), "last");
+
+  elapsed = client->stats.last_frame - client->stats.start;
+  printf("client %d: total: frames: %d, fps: %.2f\n",
+         getpid(), client->stats.frames,
+         elapsed ? (client->stats.frames - 1) * 1000000.0 / elapsed : 0.0);
+
   nested_client_destroy(client);
 
   //  printf ("client: program finished\n");
@@ -1,8 +1,18 @@
 #include "compositor.h"
+#include "passthrough.h"
+#include "bench.h"
+#include "linux-dmabuf.h"
+#include "log.h"
+#include "timing.h"
 #include "wl-event-source.h"
+#include "presentation-time-server-protocol.h"
+#include "nested-visibility-server-protocol.h"
+#include "viewporter-server-protocol.h"
 
 #include <wayland-server.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 /* EGL functions */
 static PFNGLEGLIMAGETARGETTEXTURE2DOESPROC image_target_texture_2d;
@@ -12,6 +22,463 @@ static PFNEGLBINDWAYLANDDISPLAYWL bind_display;
 static PFNEGLUNBINDWAYLANDDISPLAYWL unbind_display;
 static PFNEGLQUERYWAYLANDBUFFERWL query_buffer;
 
+static struct Scene *scene;
+
+static void compositor_schedule_apply (struct Compositor *c);
+static void compositor_update_size_request (struct Compositor *c);
+
+/* time for the size of the surfaces to settle before relayouting again */
+#define RESIZE_SETTLE_MS 100
+
+/* ===== BUFFER CACHE ====== */
+
+/* Destroys a cairo-gl surface and a texture, or leaves them to the GTK
+   thread when called from the dispatch thread, which has no context */
+static void
+compositor_destroy_gl (struct Compositor *c,
+                       cairo_surface_t *surface, GLuint texture)
+{
+  if (compositor_display_thread_is_current (c->dispatch_thread)) {
+    if (surface)
+      g_ptr_array_add (c->gl_garbage, surface);
+    if (texture)
+      g_array_append_val (c->gl_garbage_textures, texture);
+    compositor_schedule_apply (c);
+    return;
+  }
+
+  cairo_device_acquire (c->display->egl_device);
+  if (surface)
+    cairo_surface_destroy (surface);
+  if (texture)
+    glDeleteTextures (1, &texture);
+  cairo_device_release (c->display->egl_device);
+}
+
+static void
+nested_buffer_free (struct NestedBuffer *buffer)
+{
+  if (buffer->parent_buffer)
+    wl_buffer_destroy (buffer->parent_buffer);
+  g_free (buffer);
+}
+
+static void
+nested_buffer_destroy_handler (struct wl_listener *listener, void *data)
+{
+  struct NestedBuffer *buffer =
+    wl_container_of (listener, buffer, destroy_listener);
+  struct Compositor *c = buffer->compositor;
+  struct NestedSurface *surface;
+
+  wl_list_for_each (surface, &c->surface_list, link) {
+    if (surface->buffer_resource == buffer->resource)
+      surface->buffer_resource = NULL;
+    if (surface->committed_buffer_resource == buffer->resource)
+      surface->committed_buffer_resource = NULL;
+    if (surface->import_buffer == buffer)
+      surface->import_buffer = NULL;
+
+    if (surface->buffer == buffer) {
+      surface->buffer = NULL;
+      surface->buffer_release_pending = FALSE;
+    }
+
+    /* contents uploaded to the surface texture outlive the buffer */
+    if (surface->cairo_surface &&
+        surface->cairo_surface == buffer->cairo_surface) {
+      compositor_destroy_gl (c, surface->cairo_surface, 0);
+      surface->cairo_surface = NULL;
+    }
+  }
+
+  if (buffer->parent_export)
+    passthrough_export_cancel (buffer->parent_export);
+  compositor_destroy_gl (c, buffer->cairo_surface, buffer->texture);
+  /* dmabuf images belong to the wl_buffer implementation */
+  if (buffer->image != EGL_NO_IMAGE_KHR && !buffer->dmabuf)
+    destroy_image (c->display->egl_display, buffer->image);
+
+  /* the GTK thread may be dispatching the release of the export right
+     now, the buffer outlives it there */
+  if (buffer->parent_buffer &&
+      compositor_display_thread_is_current (c->dispatch_thread)) {
+    buffer->resource = NULL;
+    g_ptr_array_add (c->parent_garbage, buffer);
+    compositor_schedule_apply (c);
+    return;
+  }
+
+  nested_buffer_free (buffer);
+}
+
+static void
+nested_buffer_send_release (struct NestedBuffer *buffer)
+{
+  wl_resource_queue_event (buffer->resource, WL_BUFFER_RELEASE);
+  timing_mark (TIMING_RELEASE);
+  timing_end (TIMING_HOLD, buffer->hold_start);
+  buffer->hold_start = 0;
+}
+
+/* Hands a buffer back to its client, unless the parent compositor is
+   still showing the dmabuf export of it */
+static void
+nested_buffer_release (struct NestedBuffer *buffer)
+{
+  if (buffer->parent_busy) {
+    buffer->release_deferred = TRUE;
+    return;
+  }
+
+  nested_buffer_send_release (buffer);
+}
+
+static void
+parent_buffer_release (void *data, struct wl_buffer *parent_buffer)
+{
+  struct NestedBuffer *buffer = data;
+  struct Compositor *c = buffer->compositor;
+
+  compositor_lock (c);
+
+  /* the wl_buffer may be gone already, see nested_buffer_destroy_handler */
+  buffer->parent_busy = FALSE;
+  if (buffer->release_deferred && buffer->resource) {
+    buffer->release_deferred = FALSE;
+    nested_buffer_send_release (buffer);
+    wl_display_flush_clients (c->child_display);
+  }
+
+  compositor_unlock (c);
+}
+
+static const struct wl_buffer_listener parent_buffer_listener = {
+  parent_buffer_release
+};
+
+/* The parent compositor answered the export of a buffer, the next commit
+   of it can be passed through */
+static void
+parent_buffer_exported (struct wl_buffer *parent_buffer, void *data)
+{
+  struct NestedBuffer *buffer = data;
+
+  buffer->parent_export = NULL;
+
+  if (!parent_buffer) {
+    buffer->parent_export_failed = TRUE;
+    return;
+  }
+
+  buffer->parent_buffer = parent_buffer;
+  wl_buffer_add_listener (parent_buffer, &parent_buffer_listener, buffer);
+}
+
+static struct NestedBuffer *
+nested_buffer_from_resource (struct Compositor *c,
+                             struct wl_resource *resource)
+{
+  struct NestedBuffer *buffer;
+  struct wl_listener *listener;
+
+  listener = wl_resource_get_destroy_listener (resource,
+                                               nested_buffer_destroy_handler);
+  if (listener)
+    return wl_container_of (listener, buffer, destroy_listener);
+
+  buffer = g_new0 (struct NestedBuffer, 1);
+  buffer->resource = resource;
+  buffer->compositor = c;
+  buffer->image = EGL_NO_IMAGE_KHR;
+
+  buffer->destroy_listener.notify = nested_buffer_destroy_handler;
+  wl_resource_add_destroy_listener (resource, &buffer->destroy_listener);
+
+  return buffer;
+}
+
+static cairo_format_t
+shm_format_to_cairo (uint32_t shm_format)
+{
+  return shm_format == WL_SHM_FORMAT_XRGB8888 ?
+    CAIRO_FORMAT_RGB24 : CAIRO_FORMAT_ARGB32;
+}
+
+/* Wraps the shm pool memory of the buffer without copying it. The pool
+   can be remapped when the client resizes it, so the wrapper is only
+   reused as long as the mapping stays the same */
+static gboolean
+nested_buffer_import_shm (struct NestedBuffer *buffer)
+{
+  struct wl_shm_buffer *shm_buffer = buffer->shm_buffer;
+  void *data = wl_shm_buffer_get_data (shm_buffer);
+
+  if (buffer->cairo_surface && buffer->shm_data == data)
+    return TRUE;
+
+  if (buffer->cairo_surface)
+    cairo_surface_destroy (buffer->cairo_surface);
+
+  buffer->shm_data = data;
+  buffer->cairo_surface =
+    cairo_image_surface_create_for_data (data,
+                                         shm_format_to_cairo (wl_shm_buffer_get_format (shm_buffer)),
+                                         buffer->width, buffer->height,
+                                         wl_shm_buffer_get_stride (shm_buffer));
+
+  return TRUE;
+}
+
+/* Creates the EGLImage, GL texture and cairo surface for a buffer, only
+   the first time the buffer is drawn */
+static gboolean
+nested_buffer_import (struct NestedBuffer *buffer)
+{
+  struct Compositor *c = buffer->compositor;
+  EGLDisplay egl_display = c->display->egl_display;
+  gint64 start;
+
+  if (buffer->shm_buffer)
+    return nested_buffer_import_shm (buffer);
+
+  if (buffer->image != EGL_NO_IMAGE_KHR)
+    return TRUE;
+
+  start = timing_begin ();
+
+  if (buffer->dmabuf) {
+    /* already imported when the client created the wl_buffer */
+    buffer->image = buffer->dmabuf->image;
+  } else {
+    buffer->image =
+      create_image (egl_display, NULL, EGL_WAYLAND_BUFFER_WL,
+                    buffer->resource, NULL);
+
+    if (buffer->image == EGL_NO_IMAGE_KHR) {
+      log_error (LOG_COMPOSITOR, "failed to create EGLImage for buffer");
+      return FALSE;
+    }
+  }
+
+  cairo_device_acquire (c->display->egl_device);
+
+  glGenTextures (1, &buffer->texture);
+  glBindTexture (GL_TEXTURE_2D, buffer->texture);
+  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  image_target_texture_2d (GL_TEXTURE_2D, buffer->image);
+
+  cairo_device_release (c->display->egl_device);
+
+  /* without an alpha channel the contents are opaque, which spares
+     blending them */
+  buffer->cairo_surface =
+    cairo_gl_surface_create_for_texture (c->display->egl_device,
+                                         buffer->format == EGL_TEXTURE_RGB ?
+                                         CAIRO_CONTENT_COLOR :
+                                         CAIRO_CONTENT_COLOR_ALPHA,
+                                         buffer->texture,
+                                         buffer->width, buffer->height);
+
+  timing_end (TIMING_IMPORT, start);
+
+  return TRUE;
+}
+
+/* ===== PRESENTATION FEEDBACK ====== */
+
+static void
+destroy_nested_presentation_feedback (struct wl_resource *resource)
+{
+  struct NestedPresentationFeedback *feedback =
+    wl_resource_get_user_data (resource);
+  wl_list_remove (&feedback->link);
+  g_free (feedback);
+}
+
+static void
+discard_feedback_list (struct wl_list *list)
+{
+  struct NestedPresentationFeedback *feedback, *next;
+
+  wl_list_for_each_safe (feedback, next, list, link) {
+    wp_presentation_feedback_send_discarded (feedback->resource);
+    wl_resource_destroy (feedback->resource);
+  }
+}
+
+/* Sends the presented event from the GDK timings of the frame the
+   feedback was painted in, falling back to the predicted presentation
+   time or to the frame time when the backend doesn't know better */
+static void
+send_feedback_presented (struct NestedPresentationFeedback *feedback,
+                         GdkFrameTimings *timings)
+{
+  gint64 time = 0, refresh = 0;
+  uint32_t flags = 0;
+  uint64_t seq = feedback->frame_counter;
+
+  if (timings) {
+    time = gdk_frame_timings_get_presentation_time (timings);
+    if (!time)
+      time = gdk_frame_timings_get_predicted_presentation_time (timings);
+    if (!time)
+      time = gdk_frame_timings_get_frame_time (timings);
+    refresh = gdk_frame_timings_get_refresh_interval (timings);
+  }
+
+  if (!time)
+    time = g_get_monotonic_time ();
+
+  if (refresh)
+    flags |= WP_PRESENTATION_FEEDBACK_KIND_VSYNC;
+
+  wp_presentation_feedback_send_presented (feedback->resource,
+                                           (uint64_t) (time / G_USEC_PER_SEC) >> 32,
+                                           (time / G_USEC_PER_SEC) & 0xffffffff,
+                                           (time % G_USEC_PER_SEC) * 1000,
+                                           refresh * 1000,
+                                           seq >> 32, seq & 0xffffffff,
+                                           flags);
+  wl_resource_destroy (feedback->resource);
+}
+
+/* ===== BUFFER STATE ====== */
+
+static void
+nested_buffer_state_init (struct NestedBufferState *state)
+{
+  state->scale = 1;
+  state->transform = WL_OUTPUT_TRANSFORM_NORMAL;
+  state->src_x = state->src_y = 0;
+  state->src_width = state->src_height = -1;
+  state->dst_width = state->dst_height = -1;
+}
+
+static gboolean
+nested_buffer_state_is_identity (struct NestedBufferState *state)
+{
+  return state->scale == 1 &&
+    state->transform == WL_OUTPUT_TRANSFORM_NORMAL &&
+    state->src_width < 0 && state->dst_width < 0;
+}
+
+/* Size of a buffer once transformed and scaled, the odd transforms
+   rotating it by 90 or 270 degrees */
+static void
+nested_buffer_state_get_buffer_size (struct NestedBufferState *state,
+                                     int buffer_width, int buffer_height,
+                                     int *width, int *height)
+{
+  *width = (state->transform & 1 ? buffer_height : buffer_width) / state->scale;
+  *height = (state->transform & 1 ? buffer_width : buffer_height) / state->scale;
+}
+
+/* Size of the surface showing a buffer, the viewport overriding the
+   transformed and scaled buffer size */
+static void
+nested_buffer_state_get_surface_size (struct NestedBufferState *state,
+                                      int buffer_width, int buffer_height,
+                                      int *width, int *height)
+{
+  if (state->dst_width >= 0) {
+    *width = state->dst_width;
+    *height = state->dst_height;
+  } else if (state->src_width >= 0) {
+    *width = state->src_width;
+    *height = state->src_height;
+  } else {
+    nested_buffer_state_get_buffer_size (state, buffer_width, buffer_height,
+                                         width, height);
+  }
+}
+
+/* Matrix from surface coordinates to buffer pixels: through the viewport
+   to the transformed and scaled buffer, then back to the buffer. Returns
+   FALSE when the buffer is shown as is */
+gboolean
+nested_surface_get_buffer_matrix (struct NestedSurface *surface,
+                                  cairo_matrix_t *matrix)
+{
+  struct NestedBufferState *state = &surface->state;
+  cairo_matrix_t transform;
+  double src_x = 0, src_y = 0, src_width, src_height;
+  int width, height;
+  gboolean y_invert;
+
+  cairo_matrix_init_identity (matrix);
+
+  /* copies of the buffer are stored the right way up */
+  y_invert = surface->buffer && surface->buffer->dmabuf &&
+    surface->cairo_surface == surface->buffer->cairo_surface &&
+    linux_dmabuf_buffer_is_y_inverted (surface->buffer->dmabuf);
+
+  if ((!y_invert && nested_buffer_state_is_identity (state)) ||
+      surface->width <= 0 || surface->height <= 0)
+    return FALSE;
+
+  nested_buffer_state_get_buffer_size (state, surface->buffer_width,
+                                       surface->buffer_height,
+                                       &width, &height);
+
+  src_width = width;
+  src_height = height;
+  if (state->src_width >= 0) {
+    src_x = state->src_x;
+    src_y = state->src_y;
+    src_width = state->src_width;
+    src_height = state->src_height;
+  }
+
+  cairo_matrix_init (matrix,
+                     src_width / surface->width, 0,
+                     0, src_height / surface->height,
+                     src_x, src_y);
+
+  switch (state->transform) {
+  case WL_OUTPUT_TRANSFORM_NORMAL:
+  default:
+    cairo_matrix_init_identity (&transform);
+    break;
+  case WL_OUTPUT_TRANSFORM_90:
+    cairo_matrix_init (&transform, 0, -1, 1, 0, 0, width);
+    break;
+  case WL_OUTPUT_TRANSFORM_180:
+    cairo_matrix_init (&transform, -1, 0, 0, -1, width, height);
+    break;
+  case WL_OUTPUT_TRANSFORM_270:
+    cairo_matrix_init (&transform, 0, 1, -1, 0, height, 0);
+    break;
+  case WL_OUTPUT_TRANSFORM_FLIPPED:
+    cairo_matrix_init (&transform, -1, 0, 0, 1, width, 0);
+    break;
+  case WL_OUTPUT_TRANSFORM_FLIPPED_90:
+    cairo_matrix_init (&transform, 0, 1, 1, 0, 0, 0);
+    break;
+  case WL_OUTPUT_TRANSFORM_FLIPPED_180:
+    cairo_matrix_init (&transform, 1, 0, 0, -1, 0, height);
+    break;
+  case WL_OUTPUT_TRANSFORM_FLIPPED_270:
+    cairo_matrix_init (&transform, 0, -1, -1, 0, height, width);
+    break;
+  }
+  cairo_matrix_multiply (matrix, matrix, &transform);
+
+  cairo_matrix_init_scale (&transform, state->scale, state->scale);
+  cairo_matrix_multiply (matrix, matrix, &transform);
+
+  /* the first row of a y-inverted buffer is the bottom one */
+  if (y_invert) {
+    cairo_matrix_init (&transform, 1, 0, 0, -1, 0, surface->buffer_height);
+    cairo_matrix_multiply (matrix, matrix, &transform);
+  }
+
+  return TRUE;
+}
+
 /* ===== SURFACE INTERFACE ====== */
 
 static void
@@ -28,35 +495,86 @@ surface_destroy (struct wl_client *client, struct wl_resource *resource)
   wl_resource_destroy (resource);
 }
 
+/* The client hands the buffer over until it is released */
+static void
+surface_attach_buffer (struct NestedSurface *surface,
+                       struct NestedBuffer *buffer)
+{
+  if (!buffer->hold_start)
+    buffer->hold_start = timing_begin ();
+  surface->buffer_resource = buffer->resource;
+}
+
 static void
 surface_attach (struct wl_client *client,
                 struct wl_resource *resource,
                 struct wl_resource *buffer_resource,
                 int32_t sx, int32_t sy)
 {
-  printf ("compositor: surface_attach\n");
+  log_debug (LOG_COMPOSITOR, "surface_attach");
+  timing_mark (TIMING_ATTACH);
 
   if (!buffer_resource) {
-    g_print ("compositor: warning: surface attach with NULL buffer\n");
+    log_warning (LOG_COMPOSITOR, "surface attach with NULL buffer");
     return;
   }
 
   EGLint format;
   struct NestedSurface *surface = wl_resource_get_user_data (resource);
   struct Compositor *c = surface->compositor;
+  struct wl_shm_buffer *shm_buffer = wl_shm_buffer_get (buffer_resource);
+  struct NestedDmabufBuffer *dmabuf = linux_dmabuf_buffer_get (buffer_resource);
+  struct NestedBuffer *buffer;
+
+  if (shm_buffer) {
+    uint32_t shm_format = wl_shm_buffer_get_format (shm_buffer);
+
+    if (shm_format != WL_SHM_FORMAT_ARGB8888 &&
+        shm_format != WL_SHM_FORMAT_XRGB8888) {
+      wl_resource_post_error (buffer_resource, WL_SHM_ERROR_INVALID_FORMAT,
+                              "unhandled shm format 0x%x", shm_format);
+      return;
+    }
+
+    buffer = nested_buffer_from_resource (c, buffer_resource);
+    buffer->shm_buffer = shm_buffer;
+    buffer->width = wl_shm_buffer_get_width (shm_buffer);
+    buffer->height = wl_shm_buffer_get_height (shm_buffer);
+    surface_attach_buffer (surface, buffer);
+    return;
+  }
+
+  if (dmabuf) {
+    buffer = nested_buffer_from_resource (c, buffer_resource);
+    buffer->dmabuf = dmabuf;
+    buffer->format = linux_dmabuf_buffer_is_opaque (dmabuf) ?
+      EGL_TEXTURE_RGB : EGL_TEXTURE_RGBA;
+    buffer->width = dmabuf->width;
+    buffer->height = dmabuf->height;
+    surface_attach_buffer (surface, buffer);
+    return;
+  }
 
-  if (!query_buffer (c->display->egl_display, buffer_resource,
+  if (!query_buffer ||
+      !query_buffer (c->display->egl_display, buffer_resource,
                      EGL_TEXTURE_FORMAT, &format)) {
-    g_print ("compositor: attaching non-egl buffer\n");
+    log_warning (LOG_COMPOSITOR, "attaching non-egl buffer");
     return;
   }
 
   if (format != EGL_TEXTURE_RGB && format != EGL_TEXTURE_RGBA) {
-    g_print ("compositor: unhandled format: %x\n", format);
+    log_warning (LOG_COMPOSITOR, "unhandled format: %x", format);
     return;
   }
 
-  surface->buffer_resource = buffer_resource;
+  /* the size is needed on commit, long before the buffer is imported */
+  buffer = nested_buffer_from_resource (c, buffer_resource);
+  buffer->format = format;
+  query_buffer (c->display->egl_display, buffer_resource,
+                EGL_WIDTH, &buffer->width);
+  query_buffer (c->display->egl_display, buffer_resource,
+                EGL_HEIGHT, &buffer->height);
+  surface_attach_buffer (surface, buffer);
 }
 
 static void
@@ -64,18 +582,21 @@ surface_damage (struct wl_client *client,
                 struct wl_resource *resource,
                 int32_t x, int32_t y, int32_t width, int32_t height)
 {
-  g_print ("compositor: surface_damage not implemented\n");
+  struct NestedSurface *surface = wl_resource_get_user_data (resource);
+
+  pixman_region32_union_rect (&surface->pending_damage,
+                              &surface->pending_damage,
+                              x, y, width, height);
 }
 
 static void
 surface_frame (struct wl_client *client,
                struct wl_resource *resource, uint32_t id)
 {
-  printf ("compositor: surface frame\n");
+  log_debug (LOG_COMPOSITOR, "surface frame");
 
   struct NestedFrameCallback *callback;
   struct NestedSurface *surface = wl_resource_get_user_data (resource);
-  struct Compositor *c = surface->compositor;
 
   /* enqueue the new callback request from nested client */
   callback = g_new0 (struct NestedFrameCallback, 1);
@@ -85,14 +606,7 @@ surface_frame (struct wl_client *client,
                                   callback,
                                   destroy_nested_frame_callback);
 
-  wl_list_insert (c->frame_callback_list.prev, &callback->link);
-
-  /* the client wants to draw, so we let GTK know that it has to redraw
-     the widget*/
-
-  /* @TODO: avoid queueing a widget draw until a previous request
-     have been completed */
-  gtk_widget_queue_draw (c->widget);
+  wl_list_insert (surface->pending_frame_callback_list.prev, &callback->link);
 }
 
 static void
@@ -100,7 +614,17 @@ surface_set_opaque_region (struct wl_client *client,
                            struct wl_resource *resource,
                            struct wl_resource *region_resource)
 {
-  g_print ("compositor: surface_set_opaque_region not implemented\n");
+  struct NestedSurface *surface = wl_resource_get_user_data (resource);
+  struct NestedRegion *region;
+
+  if (region_resource) {
+    region = wl_resource_get_user_data (region_resource);
+    pixman_region32_copy (&surface->pending_opaque_region, &region->region);
+  } else {
+    pixman_region32_clear (&surface->pending_opaque_region);
+  }
+
+  surface->pending_opaque_region_set = TRUE;
 }
 
 static void
@@ -108,193 +632,1935 @@ surface_set_input_region (struct wl_client *client,
                           struct wl_resource *resource,
                           struct wl_resource *region_resource)
 {
-  g_print ("compositor: surface_set_input_region not implemented\n");
+  log_debug (LOG_COMPOSITOR, "surface_set_input_region not implemented");
 }
 
+/* Turns the damage accumulated since the last commit into widget-local
+   coordinates and only invalidates that part of the widget */
 static void
-surface_commit (struct wl_client *client, struct wl_resource *resource)
+surface_queue_damage (struct NestedSurface *surface)
 {
-  struct NestedSurface *surface = wl_resource_get_user_data (resource);
   struct Compositor *c = surface->compositor;
-  int width, height;
+  cairo_region_t *region;
+  pixman_box32_t *rects;
+  double x, y, scale_x, scale_y;
+  int i, n_rects;
 
-  /* Create EGL Image from attached buffer */
-  if (surface->image != EGL_NO_IMAGE_KHR)
-    destroy_image (c->display->egl_display, surface->image);
+  pixman_region32_intersect_rect (&surface->damage,
+                                  &surface->damage,
+                                  0, 0, surface->width, surface->height);
 
-  EGLDisplay egl_display = c->display->egl_display;
-  surface->image =
-    create_image (egl_display, NULL, EGL_WAYLAND_BUFFER_WL,
-                  surface->buffer_resource, NULL);
+  if (!pixman_region32_not_empty (&surface->damage)) {
+    /* the client asked for a frame without damaging anything, we still
+       need a frame clock cycle for its frame callbacks to be fired,
+       unless they are throttled */
+    if (!wl_list_empty (&surface->frame_callback_list) && c->frame_clock &&
+        c->visibility == VISIBILITY_VISIBLE)
+      gdk_frame_clock_request_phase (c->frame_clock,
+                                     GDK_FRAME_CLOCK_PHASE_AFTER_PAINT);
+    return;
+  }
 
-  if (surface->image == EGL_NO_IMAGE_KHR) {
-    g_print ("compositor: failed to create EGLImage on surface commit\n");
+  /* damage of a surface drawn scaled doesn't map to whole pixels, and
+     the surface is being resized anyway */
+  compositor_get_surface_geometry (c, surface, &x, &y, &scale_x, &scale_y);
+  if (scale_x != 1.0 || scale_y != 1.0) {
+    gtk_widget_queue_draw (c->widget);
+    pixman_region32_clear (&surface->damage);
     return;
   }
 
-  /* Render buffer with Cairo */
-  if (surface->cairo_surface)
-    cairo_surface_destroy (surface->cairo_surface);
+  region = cairo_region_create ();
+  rects = pixman_region32_rectangles (&surface->damage, &n_rects);
+  for (i = 0; i < n_rects; i++) {
+    cairo_rectangle_int_t rect = {
+      surface->x + rects[i].x1, surface->y + rects[i].y1,
+      rects[i].x2 - rects[i].x1, rects[i].y2 - rects[i].y1
+    };
+    cairo_region_union_rectangle (region, &rect);
+  }
 
-  query_buffer (egl_display, surface->buffer_resource, EGL_WIDTH, &width);
-  query_buffer (egl_display, surface->buffer_resource, EGL_HEIGHT, &height);
+  gtk_widget_queue_draw_region (c->widget, region);
+  cairo_region_destroy (region);
 
-  printf ("compositor: buffer width: %d\n", width);
-  printf ("compositor: buffer height: %d\n", height);
+  pixman_region32_clear (&surface->damage);
+}
 
-  cairo_device_t *device = c->display->egl_device;
-  surface->cairo_surface =
-    cairo_gl_surface_create_for_texture (device,
-                                         CAIRO_CONTENT_COLOR_ALPHA,
-                                         surface->texture,
-                                         width, height);
+static void
+upload_shm_rows (uint8_t *data, int stride, int width, int y1, int y2)
+{
+  int y;
 
-  gtk_widget_set_size_request (c->widget, width, height);
+  if (stride == width * 4) {
+    glTexSubImage2D (GL_TEXTURE_2D, 0, 0, y1, width, y2 - y1,
+                     GL_BGRA_EXT, GL_UNSIGNED_BYTE, data + y1 * stride);
+    return;
+  }
 
-  glBindTexture (GL_TEXTURE_2D, surface->texture);
-  image_target_texture_2d (GL_TEXTURE_2D, surface->image);
+  for (y = y1; y < y2; y++)
+    glTexSubImage2D (GL_TEXTURE_2D, 0, 0, y, width, 1,
+                     GL_BGRA_EXT, GL_UNSIGNED_BYTE, data + y * stride);
 }
 
+/* Rows of the buffer the damage of the commit covers. Damage is in
+   surface coordinates, only a buffer shown as is can use it directly */
 static void
-surface_set_buffer_transform(struct wl_client *client,
-			     struct wl_resource *resource, int transform)
+surface_get_damaged_rows (struct NestedSurface *surface,
+                          struct NestedBuffer *buffer, int *y1, int *y2)
 {
-  g_print ("compositor: surface_set_buffer_transform not implemented\n");
-}
+  pixman_box32_t *extents;
 
-static const struct wl_surface_interface surface_interface = {
-  surface_destroy,
-  surface_attach,
-  surface_damage,
-  surface_frame,
-  surface_set_opaque_region,
-  surface_set_input_region,
-  surface_commit,
-  surface_set_buffer_transform
-};
+  if (!nested_buffer_state_is_identity (&surface->state)) {
+    *y1 = 0;
+    *y2 = buffer->height;
+    return;
+  }
 
-/* ===== COMPOSITOR INTERFACE ====== */
+  extents = pixman_region32_extents (&surface->damage);
+  *y1 = MAX (extents->y1, 0);
+  *y2 = MIN (extents->y2, buffer->height);
+}
 
-static void
-destroy_nested_surface (struct wl_resource *resource)
+/* Whether the copy of the last wl_shm buffer kept by the surface can't
+   take buffer, whose contents are then copied whole. The format decides
+   whether the alpha channel of the copy is used */
+static gboolean
+surface_shm_copy_changed (struct NestedSurface *surface,
+                          struct NestedBuffer *buffer)
 {
-  struct NestedSurface *surface = wl_resource_get_user_data (resource);
-  g_free (surface);
+  return surface->shm_width != buffer->width ||
+    surface->shm_height != buffer->height ||
+    surface->shm_format != wl_shm_buffer_get_format (buffer->shm_buffer);
 }
 
-static void
-compositor_create_surface (struct wl_client *client, struct wl_resource *resource, uint32_t id)
+/* Copies the rows of a wl_shm buffer covered by the pending damage into
+   the texture of the surface, so that the buffer can be released right
+   away. The texture is only reallocated when the buffer size changes */
+static cairo_surface_t *
+surface_upload_shm_buffer (struct NestedSurface *surface,
+                           struct NestedBuffer *buffer)
 {
-  struct Compositor *c;
-  struct NestedSurface *surface;
+  struct Compositor *c = surface->compositor;
+  struct wl_shm_buffer *shm_buffer = buffer->shm_buffer;
+  int stride = wl_shm_buffer_get_stride (shm_buffer);
+  gboolean changed = surface_shm_copy_changed (surface, buffer);
+  uint8_t *data;
+  int y1, y2;
 
-  printf ("compositor: create surface\n");
+  cairo_device_acquire (c->display->egl_device);
 
-  c = wl_resource_get_user_data (resource);
-  surface = g_new0 (struct NestedSurface, 1);
+  if (!surface->shm_texture) {
+    glGenTextures (1, &surface->shm_texture);
+    glBindTexture (GL_TEXTURE_2D, surface->shm_texture);
+    glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  }
 
-  surface->compositor = c;
+  glBindTexture (GL_TEXTURE_2D, surface->shm_texture);
 
-  glGenTextures (1, &surface->texture);
-  glBindTexture (GL_TEXTURE_2D, surface->texture);
-  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  wl_shm_buffer_begin_access (shm_buffer);
+  data = wl_shm_buffer_get_data (shm_buffer);
 
-  struct wl_resource *surface_resource =
-    wl_resource_create (client, &wl_surface_interface, 1, id);
-  wl_resource_set_implementation (surface_resource, &surface_interface,
-                                  surface, destroy_nested_surface);
+  if (surface->shm_width != buffer->width ||
+      surface->shm_height != buffer->height) {
+    glTexImage2D (GL_TEXTURE_2D, 0, GL_BGRA_EXT,
+                  buffer->width, buffer->height, 0,
+                  GL_BGRA_EXT, GL_UNSIGNED_BYTE, NULL);
+    y1 = 0;
+    y2 = buffer->height;
+  } else if (changed) {
+    y1 = 0;
+    y2 = buffer->height;
+  } else {
+    surface_get_damaged_rows (surface, buffer, &y1, &y2);
+  }
 
-  c->nested_surface = surface;
-}
+  if (y2 > y1)
+    upload_shm_rows (data, stride, buffer->width, y1, y2);
 
-static const struct wl_compositor_interface compositor_interface = {
-  compositor_create_surface,
-};
+  wl_shm_buffer_end_access (shm_buffer);
 
-static void
-compositor_bind (struct wl_client *client, void *data, uint32_t version, uint32_t id)
-{
-  struct Compositor *c = data;
-  struct wl_resource *resource =
-    wl_resource_create(client, &wl_compositor_interface, MIN(version, 3), id);
-  wl_resource_set_implementation (resource, &compositor_interface, c, NULL);
-}
+  cairo_device_release (c->display->egl_device);
 
-static int
-compositor_init (struct Compositor *c)
-{
-  const gchar *extensions;
+  if (changed || !surface->shm_cairo_surface) {
+    if (surface->shm_cairo_surface)
+      cairo_surface_destroy (surface->shm_cairo_surface);
 
-  wl_list_init (&c->frame_callback_list);
+    surface->shm_cairo_surface =
+      cairo_gl_surface_create_for_texture (c->display->egl_device,
+                                           wl_shm_buffer_get_format (shm_buffer) == WL_SHM_FORMAT_XRGB8888 ?
+                                           CAIRO_CONTENT_COLOR : CAIRO_CONTENT_COLOR_ALPHA,
+                                           surface->shm_texture,
+                                           buffer->width, buffer->height);
+    surface->shm_width = buffer->width;
+    surface->shm_height = buffer->height;
+    surface->shm_format = wl_shm_buffer_get_format (shm_buffer);
+  }
 
-  /* Create client child display and the event source for it */
-  c->child_display = wl_display_create ();
-  compositor_display_source_new (c->child_display);
+  return surface->shm_cairo_surface;
+}
 
-  /* Register display object */
-  if (!wl_global_create (c->child_display,
-                         &wl_compositor_interface,
-                         wl_compositor_interface.version,
-                         c, compositor_bind)) {
-    g_print("compositor: failed to bind nested compositor\n");
-    return -1;
-  }
+/* Copies the rows of a GPU buffer covered by the pending damage into a
+   texture of the surface, the right way up, so that the buffer can be
+   released right away. Returns NULL when the buffer can't be imported */
+static cairo_surface_t *
+surface_copy_gpu_buffer (struct NestedSurface *surface,
+                         struct NestedBuffer *buffer)
+{
+  struct Compositor *c = surface->compositor;
+  cairo_matrix_t matrix;
+  cairo_t *cr;
+  int y1, y2;
 
-  wl_display_init_shm (c->child_display);
+  if (!nested_buffer_import (buffer))
+    return NULL;
 
-  /* Bind child display */
-  EGLDisplay egl_display = c->display->egl_display;
-  extensions = eglQueryString(egl_display, EGL_EXTENSIONS);
-  if (strstr (extensions, "EGL_WL_bind_wayland_display") == NULL) {
-    g_print ("compositor: no EGL_WL_bind_wayland_display extension\n");
-    return -1;
+  if (!surface->copy_texture) {
+    cairo_device_acquire (c->display->egl_device);
+    glGenTextures (1, &surface->copy_texture);
+    glBindTexture (GL_TEXTURE_2D, surface->copy_texture);
+    glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    cairo_device_release (c->display->egl_device);
   }
 
-  bind_display = (void *) eglGetProcAddress("eglBindWaylandDisplayWL");
-  unbind_display = (void *) eglGetProcAddress("eglUnbindWaylandDisplayWL");
-  create_image = (void *) eglGetProcAddress("eglCreateImageKHR");
-  destroy_image = (void *) eglGetProcAddress("eglDestroyImageKHR");
-  query_buffer = (void *) eglGetProcAddress("eglQueryWaylandBufferWL");
-  image_target_texture_2d =	(void *) eglGetProcAddress("glEGLImageTargetTexture2DOES");
+  if (!surface->copy_cairo_surface ||
+      surface->copy_width != buffer->width ||
+      surface->copy_height != buffer->height ||
+      cairo_surface_get_content (surface->copy_cairo_surface) !=
+      cairo_surface_get_content (buffer->cairo_surface)) {
+    if (surface->copy_cairo_surface)
+      cairo_surface_destroy (surface->copy_cairo_surface);
 
-  if (!bind_display (egl_display, c->child_display)) {
-    g_print ("compositor: failed to bind wl_display\n");
-    return -1;
+    cairo_device_acquire (c->display->egl_device);
+    glBindTexture (GL_TEXTURE_2D, surface->copy_texture);
+    glTexImage2D (GL_TEXTURE_2D, 0, GL_RGBA, buffer->width, buffer->height,
+                  0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    cairo_device_release (c->display->egl_device);
+
+    surface->copy_cairo_surface =
+      cairo_gl_surface_create_for_texture (c->display->egl_device,
+                                           cairo_surface_get_content (buffer->cairo_surface),
+                                           surface->copy_texture,
+                                           buffer->width, buffer->height);
+    surface->copy_width = buffer->width;
+    surface->copy_height = buffer->height;
+    y1 = 0;
+    y2 = buffer->height;
+  } else {
+    surface_get_damaged_rows (surface, buffer, &y1, &y2);
   }
 
-  g_print ("compositor: nested compositor initialized\n");
+  if (y2 > y1) {
+    cr = cairo_create (surface->copy_cairo_surface);
+    cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
+    cairo_set_source_surface (cr, buffer->cairo_surface, 0, 0);
+    if (buffer->dmabuf && linux_dmabuf_buffer_is_y_inverted (buffer->dmabuf)) {
+      cairo_matrix_init (&matrix, 1, 0, 0, -1, 0, buffer->height);
+      cairo_pattern_set_matrix (cairo_get_source (cr), &matrix);
+    }
+    cairo_rectangle (cr, 0, y1, buffer->width, y2 - y1);
+    cairo_fill (cr);
+    cairo_destroy (cr);
+    cairo_surface_flush (surface->copy_cairo_surface);
+  }
 
-  return 0;
+  return surface->copy_cairo_surface;
 }
 
-
-struct Compositor *
-compositor_create (GtkWidget *widget, struct Display *d)
+static gboolean
+compositor_resize_timeout (gpointer data)
 {
-  struct Compositor *c = g_new0 (struct Compositor, 1);
-  c->display = d;
-  c->widget = widget;
-  compositor_init (c);
-  return c;
+  struct Compositor *c = data;
+
+  c->resize_source = 0;
+
+  compositor_lock (c);
+  compositor_update_size_request (c);
+  compositor_unlock (c);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* The widget asks for enough room to show every nested surface. Only
+   actual changes are requested, and no more than once per
+   RESIZE_SETTLE_MS, so that a client resizing on every frame doesn't
+   relayout the UI on every frame */
+static void
+compositor_update_size_request (struct Compositor *c)
+{
+  struct NestedSurface *surface;
+  int width = 0, height = 0;
+
+  wl_list_for_each (surface, &c->surface_list, link) {
+    width = MAX (width, surface->x + surface->width);
+    height = MAX (height, surface->y + surface->height);
+  }
+
+  if (width == c->request_width && height == c->request_height)
+    return;
+
+  /* the last size is requested once it settles */
+  if (c->resize_source)
+    return;
+
+  log_debug (LOG_COMPOSITOR, "size request: %dx%d", width, height);
+
+  gtk_widget_set_size_request (c->widget, width, height);
+  c->request_width = width;
+  c->request_height = height;
+
+  c->resize_source =
+    g_timeout_add (RESIZE_SETTLE_MS, compositor_resize_timeout, c);
+}
+
+/* Where the surface is drawn in the widget, and at which scale when it
+   doesn't fit in the widget, following the resize policy */
+void
+compositor_get_surface_geometry (struct Compositor *c,
+                                 struct NestedSurface *surface,
+                                 double *x, double *y,
+                                 double *scale_x, double *scale_y)
+{
+  int width = gtk_widget_get_allocated_width (c->widget) - surface->x;
+  int height = gtk_widget_get_allocated_height (c->widget) - surface->y;
+  double scale;
+
+  *x = surface->x;
+  *y = surface->y;
+  *scale_x = *scale_y = 1.0;
+
+  if (c->resize_policy == RESIZE_CROP ||
+      width <= 0 || height <= 0 ||
+      (surface->width <= width && surface->height <= height))
+    return;
+
+  *scale_x = (double) width / surface->width;
+  *scale_y = (double) height / surface->height;
+
+  if (c->resize_policy == RESIZE_LETTERBOX) {
+    scale = MIN (*scale_x, *scale_y);
+    *scale_x = *scale_y = scale;
+    *x += (width - surface->width * scale) / 2;
+    *y += (height - surface->height * scale) / 2;
+  }
+}
+
+/* Copies the damaged rows of a wl_shm buffer into an image surface owned
+   by the surface, for releasing the buffer early without GL uploads */
+static cairo_surface_t *
+surface_copy_shm_buffer (struct NestedSurface *surface,
+                         struct NestedBuffer *buffer)
+{
+  struct wl_shm_buffer *shm_buffer = buffer->shm_buffer;
+  int stride = wl_shm_buffer_get_stride (shm_buffer);
+  uint8_t *src, *dst;
+  int dst_stride;
+  int y, y1, y2;
+
+  if (!surface->shm_cairo_surface ||
+      surface_shm_copy_changed (surface, buffer)) {
+    if (surface->shm_cairo_surface)
+      cairo_surface_destroy (surface->shm_cairo_surface);
+
+    surface->shm_cairo_surface =
+      cairo_image_surface_create (shm_format_to_cairo (wl_shm_buffer_get_format (shm_buffer)),
+                                  buffer->width, buffer->height);
+    surface->shm_width = buffer->width;
+    surface->shm_height = buffer->height;
+    surface->shm_format = wl_shm_buffer_get_format (shm_buffer);
+    y1 = 0;
+    y2 = buffer->height;
+  } else {
+    surface_get_damaged_rows (surface, buffer, &y1, &y2);
+  }
+
+  cairo_surface_flush (surface->shm_cairo_surface);
+  dst = cairo_image_surface_get_data (surface->shm_cairo_surface);
+  dst_stride = cairo_image_surface_get_stride (surface->shm_cairo_surface);
+
+  wl_shm_buffer_begin_access (shm_buffer);
+  src = wl_shm_buffer_get_data (shm_buffer);
+  for (y = y1; y < y2; y++)
+    memcpy (dst + y * dst_stride, src + y * stride, buffer->width * 4);
+  wl_shm_buffer_end_access (shm_buffer);
+
+  cairo_surface_mark_dirty (surface->shm_cairo_surface);
+
+  return surface->shm_cairo_surface;
+}
+
+/* Makes contents the contents of the surface, the previous buffer is
+   not referenced anymore then, whatever the release policy */
+static void
+surface_set_contents (struct NestedSurface *surface,
+                      struct NestedBuffer *buffer,
+                      cairo_surface_t *contents)
+{
+  if (surface->buffer != buffer) {
+    if (surface->buffer && surface->buffer_release_pending)
+      nested_buffer_release (surface->buffer);
+    surface->buffer = buffer;
+  }
+
+  if (surface->cairo_surface != contents) {
+    if (surface->cairo_surface)
+      cairo_surface_destroy (surface->cairo_surface);
+    surface->cairo_surface = cairo_surface_reference (contents);
+  }
+}
+
+/* Imports the buffer of the last commit, if it wasn't drawn yet */
+static void
+nested_surface_import (struct NestedSurface *surface)
+{
+  struct NestedBuffer *buffer = surface->import_buffer;
+
+  if (!buffer)
+    return;
+
+  surface->import_buffer = NULL;
+
+  if (!nested_buffer_import (buffer)) {
+    if (buffer != surface->buffer)
+      nested_buffer_release (buffer);
+    return;
+  }
+
+  surface_set_contents (surface, buffer, buffer->cairo_surface);
+  surface->buffer_release_pending = TRUE;
+}
+
+/* The buffers of a surface can go straight to the parent compositor when
+   it is the only one and covers the whole widget, and its contents are
+   an EGLImage that can be exported as dmabufs */
+static gboolean
+surface_can_pass_through (struct NestedSurface *surface)
+{
+  struct Compositor *c = surface->compositor;
+  struct NestedBuffer *buffer;
+
+  if (!c->passthrough || wl_list_length (&c->surface_list) != 1)
+    return FALSE;
+
+  /* the parent compositor shows the buffer as is, only scaled. That
+     needs wl_surface version 3 there */
+  if (surface->state.transform != WL_OUTPUT_TRANSFORM_NORMAL ||
+      surface->state.src_width >= 0 || surface->state.dst_width >= 0 ||
+      (surface->state.scale != 1 &&
+       wl_proxy_get_version ((struct wl_proxy *) c->display->compositor) < 3))
+    return FALSE;
+
+  if (surface->x > 0 || surface->y > 0 ||
+      surface->width < gtk_widget_get_allocated_width (c->widget) ||
+      surface->height < gtk_widget_get_allocated_height (c->widget))
+    return FALSE;
+
+  /* the parent compositor needs the EGLImage right away */
+  nested_surface_import (surface);
+  buffer = surface->buffer;
+
+  if (!buffer || buffer->image == EGL_NO_IMAGE_KHR ||
+      surface->cairo_surface != buffer->cairo_surface)
+    return FALSE;
+
+  /* the exported buffer carries no y-invert flag */
+  if (buffer->dmabuf && linux_dmabuf_buffer_is_y_inverted (buffer->dmabuf))
+    return FALSE;
+
+  /* we keep drawing the buffer until the parent compositor answers */
+  if (!buffer->parent_buffer && !buffer->parent_export &&
+      !buffer->parent_export_failed) {
+    buffer->parent_export =
+      passthrough_export_buffer (c->passthrough, buffer->image,
+                                 buffer->width, buffer->height,
+                                 parent_buffer_exported, buffer);
+    if (!buffer->parent_export)
+      buffer->parent_export_failed = TRUE;
+  }
+
+  return buffer->parent_buffer != NULL;
+}
+
+/* Part of the surface, in surface coordinates, that has no transparency:
+   all of it when the contents have no alpha channel, otherwise what the
+   client declared opaque */
+void
+nested_surface_get_opaque_region (struct NestedSurface *surface,
+                                  pixman_region32_t *region)
+{
+  struct NestedBuffer *buffer = surface->import_buffer;
+  gboolean opaque;
+
+  pixman_region32_init (region);
+
+  if (buffer && buffer->shm_buffer)
+    opaque = wl_shm_buffer_get_format (buffer->shm_buffer) == WL_SHM_FORMAT_XRGB8888;
+  else if (buffer)
+    opaque = buffer->format == EGL_TEXTURE_RGB;
+  else if (surface->cairo_surface)
+    opaque = cairo_surface_get_content (surface->cairo_surface) == CAIRO_CONTENT_COLOR;
+  else
+    return;
+
+  if (opaque)
+    pixman_region32_union_rect (region, region,
+                                0, 0, surface->width, surface->height);
+  else
+    pixman_region32_intersect_rect (region, &surface->opaque_region,
+                                    0, 0, surface->width, surface->height);
+}
+
+/* Texture the contents of a surface are in, when they are in one */
+GLuint
+nested_surface_get_texture (struct NestedSurface *surface, gboolean *opaque)
+{
+  struct NestedBuffer *buffer = surface->buffer;
+
+  if (!surface->cairo_surface)
+    return 0;
+
+  *opaque = cairo_surface_get_content (surface->cairo_surface) == CAIRO_CONTENT_COLOR;
+
+  if (surface->shm_texture &&
+      surface->cairo_surface == surface->shm_cairo_surface)
+    return surface->shm_texture;
+
+  if (surface->copy_texture &&
+      surface->cairo_surface == surface->copy_cairo_surface)
+    return surface->copy_texture;
+
+  if (buffer && buffer->texture &&
+      surface->cairo_surface == buffer->cairo_surface) {
+    *opaque = *opaque || buffer->format == EGL_TEXTURE_RGB;
+    return buffer->texture;
+  }
+
+  return 0;
+}
+
+/* Lets GDK know which part of the widget is covered by opaque contents,
+   only when that changes */
+static void
+compositor_update_opaque_region (struct Compositor *c)
+{
+  GdkWindow *window = gtk_widget_get_window (c->widget);
+  struct NestedSurface *surface;
+  pixman_region32_t region, opaque;
+  cairo_region_t *cairo_region;
+  pixman_box32_t *rects;
+  double x, y, scale_x, scale_y;
+  int i, n_rects;
+
+  pixman_region32_init (&region);
+  wl_list_for_each (surface, &c->surface_list, link) {
+    /* scaled surfaces are not worth the trouble, they are transient */
+    compositor_get_surface_geometry (c, surface, &x, &y, &scale_x, &scale_y);
+    if (scale_x != 1.0 || scale_y != 1.0)
+      continue;
+
+    nested_surface_get_opaque_region (surface, &opaque);
+    pixman_region32_translate (&opaque, surface->x, surface->y);
+    pixman_region32_union (&region, &region, &opaque);
+    pixman_region32_fini (&opaque);
+  }
+
+  if (pixman_region32_equal (&region, &c->opaque_region)) {
+    pixman_region32_fini (&region);
+    return;
+  }
+
+  pixman_region32_copy (&c->opaque_region, &region);
+
+  if (window && gtk_widget_get_has_window (c->widget)) {
+    cairo_region = cairo_region_create ();
+    rects = pixman_region32_rectangles (&region, &n_rects);
+    for (i = 0; i < n_rects; i++) {
+      cairo_rectangle_int_t rect = {
+        rects[i].x1, rects[i].y1,
+        rects[i].x2 - rects[i].x1, rects[i].y2 - rects[i].y1
+      };
+      cairo_region_union_rectangle (cairo_region, &rect);
+    }
+
+    gdk_window_set_opaque_region (window, cairo_region);
+    cairo_region_destroy (cairo_region);
+  }
+
+  pixman_region32_fini (&region);
+}
+
+/* Shows the committed state of the surface, either by forwarding its
+   buffer to the parent compositor or by invalidating the widget */
+static void
+surface_present (struct NestedSurface *surface)
+{
+  struct Compositor *c = surface->compositor;
+
+  compositor_update_opaque_region (c);
+
+  if (surface_can_pass_through (surface)) {
+    passthrough_attach (c->passthrough, surface->buffer->parent_buffer,
+                        surface->state.scale, &surface->damage);
+    surface->buffer->parent_busy = TRUE;
+    c->passthrough_surface = surface;
+    pixman_region32_clear (&surface->damage);
+
+    /* nothing to draw, but frame callbacks still come from the clock */
+    if (c->frame_clock)
+      gdk_frame_clock_request_phase (c->frame_clock,
+                                     GDK_FRAME_CLOCK_PHASE_AFTER_PAINT);
+    return;
+  }
+
+  if (c->passthrough_surface) {
+    passthrough_hide (c->passthrough);
+    c->passthrough_surface = NULL;
+    gtk_widget_queue_draw (c->widget);
+  }
+
+  surface_queue_damage (surface);
+}
+
+/* Marks the damage of the commit as stale in the GDK texture */
+static void
+surface_damage_gdk_texture (struct NestedSurface *surface)
+{
+  pixman_region32_union (&surface->gdk_damage, &surface->gdk_damage,
+                         &surface->damage);
+  surface->gdk_texture_dirty = TRUE;
 }
 
+/* Takes the buffer state of the last commit and sizes the surface for
+   it. A buffer shown differently invalidates the whole surface. Returns
+   whether the size changed */
+static gboolean
+surface_apply_state (struct NestedSurface *surface)
+{
+  gboolean changed, resized;
+  int width = 0, height = 0;
+
+  changed = memcmp (&surface->state, &surface->committed_state,
+                    sizeof surface->state) != 0;
+  surface->state = surface->committed_state;
+
+  if (surface->buffer_width > 0 && surface->buffer_height > 0)
+    nested_buffer_state_get_surface_size (&surface->state,
+                                          surface->buffer_width,
+                                          surface->buffer_height,
+                                          &width, &height);
+
+  resized = width != surface->width || height != surface->height;
+  if (changed || resized)
+    pixman_region32_union_rect (&surface->damage, &surface->damage,
+                                0, 0, width, height);
+
+  surface->width = width;
+  surface->height = height;
+  if (changed)
+    surface_damage_gdk_texture (surface);
+
+  return resized;
+}
+
+/* Copies the latched buffer or leaves it for the draw to import, and
+   shows it. This needs GTK and the GL context, so it always runs on the
+   GTK thread */
+static void
+surface_apply_commit (struct NestedSurface *surface)
+{
+  struct Compositor *c = surface->compositor;
+  struct NestedBuffer *buffer;
+  cairo_surface_t *contents;
+  gboolean copied, resized;
+
+  if (!surface->committed_buffer_resource) {
+    if (surface_apply_state (surface))
+      compositor_update_size_request (c);
+    surface_present (surface);
+    return;
+  }
+
+  /* Look up the import for the attached buffer, only creating the
+     EGLImage the first time we see it */
+  buffer = nested_buffer_from_resource (c, surface->committed_buffer_resource);
+  surface->committed_buffer_resource = NULL;
+
+  resized = surface->buffer_width != buffer->width ||
+    surface->buffer_height != buffer->height;
+  surface->buffer_width = buffer->width;
+  surface->buffer_height = buffer->height;
+  surface_apply_state (surface);
+
+  /* a buffer of a different size invalidates the whole surface */
+  if (resized)
+    pixman_region32_union_rect (&surface->damage, &surface->damage,
+                                0, 0, surface->width, surface->height);
+
+  log_debug (LOG_COMPOSITOR, "buffer size: %dx%d", buffer->width, buffer->height);
+
+  /* a buffer that was never drawn is superseded by this one */
+  if (surface->import_buffer && surface->import_buffer != buffer &&
+      surface->import_buffer != surface->buffer)
+    nested_buffer_release (surface->import_buffer);
+  surface->import_buffer = NULL;
+
+  copied = c->release_policy == BUFFER_RELEASE_EARLY ||
+    (buffer->shm_buffer && c->shm_path == SHM_PATH_GL);
+  if (copied) {
+    if (!buffer->shm_buffer)
+      contents = surface_copy_gpu_buffer (surface, buffer);
+    else if (c->shm_path == SHM_PATH_GL)
+      contents = surface_upload_shm_buffer (surface, buffer);
+    else
+      contents = surface_copy_shm_buffer (surface, buffer);
+
+    /* a buffer that can't be imported leaves the previous contents */
+    if (contents)
+      surface_set_contents (surface, buffer, contents);
+
+    /* copied contents don't reference the buffer anymore */
+    nested_buffer_release (buffer);
+    surface->buffer_release_pending = FALSE;
+  } else {
+    /* the import waits for the widget to draw, buffers committed
+       faster than that or while hidden are never imported */
+    surface->import_buffer = buffer;
+  }
+
+  surface_damage_gdk_texture (surface);
+  compositor_update_size_request (c);
+
+  surface_present (surface);
+}
+
+/* Imports what the surfaces show before drawing them. The first view
+   drawn in a frame imports for every view painted by the same frame
+   clock, so that the GL context is only taken once per frame */
 void
-compositor_frame_done (struct Compositor *c)
+compositor_import_surfaces (struct Compositor *c)
+{
+  struct Compositor *view;
+  struct NestedSurface *surface;
+  gint64 frame = -1;
+
+  if (c->frame_clock) {
+    frame = gdk_frame_clock_get_frame_counter (c->frame_clock);
+    if (c->import_frame == frame)
+      return;
+  }
+
+  cairo_device_acquire (c->display->egl_device);
+
+  wl_list_for_each (view, &c->scene->compositor_list, link) {
+    if (view != c &&
+        (!c->frame_clock || view->frame_clock != c->frame_clock ||
+         view->visibility != VISIBILITY_VISIBLE))
+      continue;
+
+    view->import_frame = frame;
+    wl_list_for_each (surface, &view->surface_list, link)
+      nested_surface_import (surface);
+  }
+
+  cairo_device_release (c->display->egl_device);
+}
+
+/* A viewport source has to fit in the buffer the commit shows, and have
+   an integer size unless a destination is set */
+static gboolean
+surface_check_viewport (struct NestedSurface *surface)
+{
+  struct NestedBufferState *state = &surface->pending_state;
+  struct wl_resource *buffer_resource;
+  struct NestedBuffer *buffer;
+  int buffer_width = surface->buffer_width;
+  int buffer_height = surface->buffer_height;
+  int width, height;
+
+  if (!surface->viewport || state->src_width < 0)
+    return TRUE;
+
+  buffer_resource = surface->buffer_resource ?
+    surface->buffer_resource : surface->committed_buffer_resource;
+  if (buffer_resource) {
+    buffer = nested_buffer_from_resource (surface->compositor, buffer_resource);
+    buffer_width = buffer->width;
+    buffer_height = buffer->height;
+  }
+
+  nested_buffer_state_get_buffer_size (state, buffer_width, buffer_height,
+                                       &width, &height);
+  if (buffer_width > 0 &&
+      (state->src_x + state->src_width > width ||
+       state->src_y + state->src_height > height)) {
+    wl_resource_post_error (surface->viewport, WP_VIEWPORT_ERROR_OUT_OF_BUFFER,
+                            "source rectangle extends outside of the buffer");
+    return FALSE;
+  }
+
+  if (state->dst_width < 0 &&
+      (state->src_width != (int) state->src_width ||
+       state->src_height != (int) state->src_height)) {
+    wl_resource_post_error (surface->viewport, WP_VIEWPORT_ERROR_BAD_SIZE,
+                            "source size is not integer without a destination");
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static void
+surface_commit (struct wl_client *client, struct wl_resource *resource)
+{
+  struct NestedSurface *surface = wl_resource_get_user_data (resource);
+  struct Compositor *c = surface->compositor;
+  struct NestedBuffer *committed;
+  gint64 start = timing_begin ();
+
+  if (!surface_check_viewport (surface))
+    return;
+
+  /* frame callbacks requested since the last commit become current */
+  wl_list_insert_list (surface->frame_callback_list.prev,
+                       &surface->pending_frame_callback_list);
+  wl_list_init (&surface->pending_frame_callback_list);
+
+  /* contents committed before and not painted yet are superseded */
+  discard_feedback_list (&surface->feedback_list);
+  wl_list_insert_list (&surface->feedback_list,
+                       &surface->pending_feedback_list);
+  wl_list_init (&surface->pending_feedback_list);
+
+  if (surface->buffer_resource) {
+    /* a buffer latched by a commit that wasn't applied yet is never
+       going to be shown */
+    if (surface->committed_buffer_resource &&
+        surface->committed_buffer_resource != surface->buffer_resource) {
+      committed = nested_buffer_from_resource (c, surface->committed_buffer_resource);
+      if (committed != surface->buffer)
+        nested_buffer_release (committed);
+    }
+
+    surface->committed_buffer_resource = surface->buffer_resource;
+    surface->buffer_resource = NULL;
+
+    if (bench_enabled && !surface->commit_time)
+      surface->commit_time = g_get_monotonic_time ();
+  }
+
+  pixman_region32_union (&surface->damage, &surface->damage,
+                         &surface->pending_damage);
+  pixman_region32_clear (&surface->pending_damage);
+
+  if (surface->pending_opaque_region_set) {
+    pixman_region32_copy (&surface->opaque_region,
+                          &surface->pending_opaque_region);
+    surface->pending_opaque_region_set = FALSE;
+  }
+
+  surface->committed_state = surface->pending_state;
+
+  if (c->dispatch_thread) {
+    surface->commit_pending = TRUE;
+    compositor_schedule_apply (c);
+  } else {
+    surface_apply_commit (surface);
+  }
+
+  timing_end (TIMING_COMMIT, start);
+}
+
+static void
+surface_set_buffer_transform (struct wl_client *client,
+                              struct wl_resource *resource, int transform)
+{
+  struct NestedSurface *surface = wl_resource_get_user_data (resource);
+
+  if (transform < WL_OUTPUT_TRANSFORM_NORMAL ||
+      transform > WL_OUTPUT_TRANSFORM_FLIPPED_270) {
+    wl_resource_post_error (resource, WL_SURFACE_ERROR_INVALID_TRANSFORM,
+                            "buffer transform must be a valid transform "
+                            "(%d specified)", transform);
+    return;
+  }
+
+  surface->pending_state.transform = transform;
+}
+
+static void
+surface_set_buffer_scale (struct wl_client *client,
+                          struct wl_resource *resource, int32_t scale)
+{
+  struct NestedSurface *surface = wl_resource_get_user_data (resource);
+
+  if (scale < 1) {
+    wl_resource_post_error (resource, WL_SURFACE_ERROR_INVALID_SCALE,
+                            "buffer scale must be at least one "
+                            "(%d specified)", scale);
+    return;
+  }
+
+  surface->pending_state.scale = scale;
+}
+
+static const struct wl_surface_interface surface_interface = {
+  surface_destroy,
+  surface_attach,
+  surface_damage,
+  surface_frame,
+  surface_set_opaque_region,
+  surface_set_input_region,
+  surface_commit,
+  surface_set_buffer_transform,
+  surface_set_buffer_scale
+};
+
+/* ===== COMPOSITOR INTERFACE ====== */
+
+static void
+destroy_nested_surface (struct wl_resource *resource)
 {
+  struct NestedSurface *surface = wl_resource_get_user_data (resource);
+  struct Compositor *c = surface->compositor;
+
   struct NestedFrameCallback *nc, *next;
-  wl_list_for_each_safe (nc, next, &c->frame_callback_list, link) {
-    wl_callback_send_done (nc->resource, 0);
+
+  wl_list_remove (&surface->link);
+
+  wl_list_for_each_safe (nc, next, &surface->pending_frame_callback_list, link)
+    wl_resource_destroy (nc->resource);
+  wl_list_for_each_safe (nc, next, &surface->frame_callback_list, link)
     wl_resource_destroy (nc->resource);
+
+  discard_feedback_list (&surface->pending_feedback_list);
+  discard_feedback_list (&surface->feedback_list);
+
+  /* requests on the viewport are errors from now on */
+  if (surface->viewport)
+    wl_resource_set_user_data (surface->viewport, NULL);
+
+  /* the contents of the surface have to go away from the widget */
+  if (surface->width > 0 && surface->height > 0) {
+    if (c->dispatch_thread) {
+      c->surfaces_changed = TRUE;
+      compositor_schedule_apply (c);
+    } else {
+      gtk_widget_queue_draw_area (c->widget, surface->x, surface->y,
+                                  surface->width, surface->height);
+      compositor_update_size_request (c);
+      compositor_update_opaque_region (c);
+    }
   }
-  wl_list_init (&c->frame_callback_list);
-  wl_display_flush_clients (c->child_display);
 
-  if (c->nested_surface && c->nested_surface->buffer_resource) {
-    wl_resource_queue_event (c->nested_surface->buffer_resource,
-                             WL_BUFFER_RELEASE);
-    c->nested_surface->buffer_resource = NULL;
+  compositor_destroy_gl (c, surface->cairo_surface, 0);
+  compositor_destroy_gl (c, surface->shm_cairo_surface, surface->shm_texture);
+  compositor_destroy_gl (c, surface->copy_cairo_surface, surface->copy_texture);
+  compositor_destroy_gl (c, NULL, surface->gdk_texture);
+
+  pixman_region32_fini (&surface->pending_damage);
+  pixman_region32_fini (&surface->damage);
+  pixman_region32_fini (&surface->gdk_damage);
+  pixman_region32_fini (&surface->pending_opaque_region);
+  pixman_region32_fini (&surface->opaque_region);
+
+  if (surface->buffer && surface->buffer_release_pending)
+    nested_buffer_release (surface->buffer);
+  if (surface->import_buffer && surface->import_buffer != surface->buffer)
+    nested_buffer_release (surface->import_buffer);
+
+  if (c->passthrough_surface == surface) {
+    c->passthrough_surface = NULL;
+    if (c->dispatch_thread) {
+      c->passthrough_hide_pending = TRUE;
+      compositor_schedule_apply (c);
+    } else {
+      passthrough_hide (c->passthrough);
+    }
   }
+
+  g_free (surface);
+}
+
+static void
+compositor_create_surface (struct wl_client *client, struct wl_resource *resource, uint32_t id)
+{
+  struct Compositor *c;
+  struct NestedSurface *surface;
+
+  log_debug (LOG_COMPOSITOR, "create surface");
+
+  c = wl_resource_get_user_data (resource);
+  surface = g_new0 (struct NestedSurface, 1);
+
+  surface->compositor = c;
+  pixman_region32_init (&surface->pending_damage);
+  pixman_region32_init (&surface->damage);
+  pixman_region32_init (&surface->gdk_damage);
+  pixman_region32_init (&surface->pending_opaque_region);
+  pixman_region32_init (&surface->opaque_region);
+  nested_buffer_state_init (&surface->pending_state);
+  nested_buffer_state_init (&surface->committed_state);
+  nested_buffer_state_init (&surface->state);
+  wl_list_init (&surface->pending_frame_callback_list);
+  wl_list_init (&surface->frame_callback_list);
+  wl_list_init (&surface->pending_feedback_list);
+  wl_list_init (&surface->feedback_list);
+
+  struct wl_resource *surface_resource =
+    wl_resource_create (client, &wl_surface_interface,
+                        wl_resource_get_version (resource), id);
+  wl_resource_set_implementation (surface_resource, &surface_interface,
+                                  surface, destroy_nested_surface);
+
+  wl_list_insert (c->surface_list.prev, &surface->link);
+}
+
+/* ===== REGION INTERFACE ====== */
+
+static void
+region_destroy (struct wl_client *client, struct wl_resource *resource)
+{
+  wl_resource_destroy (resource);
+}
+
+static void
+region_add (struct wl_client *client, struct wl_resource *resource,
+            int32_t x, int32_t y, int32_t width, int32_t height)
+{
+  struct NestedRegion *region = wl_resource_get_user_data (resource);
+
+  pixman_region32_union_rect (&region->region, &region->region,
+                              x, y, width, height);
+}
+
+static void
+region_subtract (struct wl_client *client, struct wl_resource *resource,
+                 int32_t x, int32_t y, int32_t width, int32_t height)
+{
+  struct NestedRegion *region = wl_resource_get_user_data (resource);
+  pixman_region32_t rect;
+
+  pixman_region32_init_rect (&rect, x, y, width, height);
+  pixman_region32_subtract (&region->region, &region->region, &rect);
+  pixman_region32_fini (&rect);
+}
+
+static const struct wl_region_interface region_interface = {
+  region_destroy,
+  region_add,
+  region_subtract
+};
+
+static void
+destroy_nested_region (struct wl_resource *resource)
+{
+  struct NestedRegion *region = wl_resource_get_user_data (resource);
+
+  pixman_region32_fini (&region->region);
+  g_free (region);
+}
+
+static void
+compositor_create_region (struct wl_client *client,
+                          struct wl_resource *resource, uint32_t id)
+{
+  struct NestedRegion *region;
+
+  region = g_new0 (struct NestedRegion, 1);
+  pixman_region32_init (&region->region);
+
+  region->resource = wl_resource_create (client, &wl_region_interface, 1, id);
+  wl_resource_set_implementation (region->resource, &region_interface,
+                                  region, destroy_nested_region);
+}
+
+static const struct wl_compositor_interface compositor_interface = {
+  compositor_create_surface,
+  compositor_create_region
+};
+
+/* ===== VIEWPORTER INTERFACE ====== */
+
+static void
+viewport_destroy (struct wl_client *client, struct wl_resource *resource)
+{
+  wl_resource_destroy (resource);
+}
+
+static void
+viewport_set_source (struct wl_client *client, struct wl_resource *resource,
+                     wl_fixed_t x, wl_fixed_t y,
+                     wl_fixed_t width, wl_fixed_t height)
+{
+  struct NestedSurface *surface = wl_resource_get_user_data (resource);
+  struct NestedBufferState *state;
+
+  if (!surface) {
+    wl_resource_post_error (resource, WP_VIEWPORT_ERROR_NO_SURFACE,
+                            "the wl_surface of the viewport is gone");
+    return;
+  }
+
+  state = &surface->pending_state;
+
+  /* all -1 unsets the source */
+  if (x == wl_fixed_from_int (-1) && y == wl_fixed_from_int (-1) &&
+      width == wl_fixed_from_int (-1) && height == wl_fixed_from_int (-1)) {
+    state->src_x = state->src_y = 0;
+    state->src_width = state->src_height = -1;
+    return;
+  }
+
+  if (x < 0 || y < 0 || width <= 0 || height <= 0) {
+    wl_resource_post_error (resource, WP_VIEWPORT_ERROR_BAD_VALUE,
+                            "invalid source rectangle %f,%f %fx%f",
+                            wl_fixed_to_double (x), wl_fixed_to_double (y),
+                            wl_fixed_to_double (width),
+                            wl_fixed_to_double (height));
+    return;
+  }
+
+  state->src_x = wl_fixed_to_double (x);
+  state->src_y = wl_fixed_to_double (y);
+  state->src_width = wl_fixed_to_double (width);
+  state->src_height = wl_fixed_to_double (height);
+}
+
+static void
+viewport_set_destination (struct wl_client *client,
+                          struct wl_resource *resource,
+                          int32_t width, int32_t height)
+{
+  struct NestedSurface *surface = wl_resource_get_user_data (resource);
+  struct NestedBufferState *state;
+
+  if (!surface) {
+    wl_resource_post_error (resource, WP_VIEWPORT_ERROR_NO_SURFACE,
+                            "the wl_surface of the viewport is gone");
+    return;
+  }
+
+  state = &surface->pending_state;
+
+  /* -1x-1 unsets the destination */
+  if (width == -1 && height == -1) {
+    state->dst_width = state->dst_height = -1;
+    return;
+  }
+
+  if (width <= 0 || height <= 0) {
+    wl_resource_post_error (resource, WP_VIEWPORT_ERROR_BAD_VALUE,
+                            "invalid destination size %dx%d", width, height);
+    return;
+  }
+
+  state->dst_width = width;
+  state->dst_height = height;
+}
+
+static const struct wp_viewport_interface viewport_interface = {
+  viewport_destroy,
+  viewport_set_source,
+  viewport_set_destination
+};
+
+/* The surface goes back to showing its buffer as is with its next
+   commit */
+static void
+destroy_nested_viewport (struct wl_resource *resource)
+{
+  struct NestedSurface *surface = wl_resource_get_user_data (resource);
+
+  if (!surface)
+    return;
+
+  surface->viewport = NULL;
+  surface->pending_state.src_x = surface->pending_state.src_y = 0;
+  surface->pending_state.src_width = surface->pending_state.src_height = -1;
+  surface->pending_state.dst_width = surface->pending_state.dst_height = -1;
+}
+
+static void
+viewporter_destroy (struct wl_client *client, struct wl_resource *resource)
+{
+  wl_resource_destroy (resource);
+}
+
+static void
+viewporter_get_viewport (struct wl_client *client,
+                         struct wl_resource *resource,
+                         uint32_t id, struct wl_resource *surface_resource)
+{
+  struct NestedSurface *surface = wl_resource_get_user_data (surface_resource);
+
+  if (surface->viewport) {
+    wl_resource_post_error (resource, WP_VIEWPORTER_ERROR_VIEWPORT_EXISTS,
+                            "the surface already has a viewport");
+    return;
+  }
+
+  surface->viewport =
+    wl_resource_create (client, &wp_viewport_interface, 1, id);
+  wl_resource_set_implementation (surface->viewport, &viewport_interface,
+                                  surface, destroy_nested_viewport);
+}
+
+static const struct wp_viewporter_interface viewporter_interface = {
+  viewporter_destroy,
+  viewporter_get_viewport
+};
+
+static void
+viewporter_bind (struct wl_client *client, void *data, uint32_t version, uint32_t id)
+{
+  struct wl_resource *resource =
+    wl_resource_create (client, &wp_viewporter_interface, 1, id);
+  wl_resource_set_implementation (resource, &viewporter_interface, NULL, NULL);
+}
+
+/* ===== CLIENTS ====== */
+
+struct NestedClient {
+  struct wl_listener destroy_listener;
+  struct Compositor *compositor;
+};
+
+static void
+nested_client_destroy (struct wl_listener *listener, void *data)
+{
+  struct NestedClient *nc = wl_container_of (listener, nc, destroy_listener);
+  g_free (nc);
+}
+
+/* Routes the globals bound by a client to the compositor of a view */
+void
+compositor_add_client (struct Compositor *c, struct wl_client *client)
+{
+  struct NestedClient *nc = g_new0 (struct NestedClient, 1);
+
+  nc->compositor = c;
+  nc->destroy_listener.notify = nested_client_destroy;
+  wl_client_add_destroy_listener (client, &nc->destroy_listener);
+}
+
+/* Compositor of the view a client was launched for, the first view for
+   clients we don't know about */
+static struct Compositor *
+compositor_from_client (struct Scene *s, struct wl_client *client)
+{
+  struct wl_listener *listener;
+  struct NestedClient *nc;
+  struct Compositor *c;
+
+  listener = wl_client_get_destroy_listener (client, nested_client_destroy);
+  if (listener)
+    return wl_container_of (listener, nc, destroy_listener)->compositor;
+
+  return wl_container_of (s->compositor_list.next, c, link);
+}
+
+static void
+compositor_bind (struct wl_client *client, void *data, uint32_t version, uint32_t id)
+{
+  struct Compositor *c = compositor_from_client (data, client);
+  struct wl_resource *resource =
+    wl_resource_create(client, &wl_compositor_interface, MIN(version, 3), id);
+  wl_resource_set_implementation (resource, &compositor_interface, c, NULL);
+}
+
+/* ===== PRESENTATION INTERFACE ====== */
+
+static void
+presentation_destroy (struct wl_client *client, struct wl_resource *resource)
+{
+  wl_resource_destroy (resource);
+}
+
+static void
+presentation_feedback (struct wl_client *client,
+                       struct wl_resource *resource,
+                       struct wl_resource *surface_resource,
+                       uint32_t id)
+{
+  struct NestedSurface *surface = wl_resource_get_user_data (surface_resource);
+  struct NestedPresentationFeedback *feedback;
+
+  feedback = g_new0 (struct NestedPresentationFeedback, 1);
+  feedback->resource =
+    wl_resource_create (client, &wp_presentation_feedback_interface, 1, id);
+  wl_resource_set_implementation (feedback->resource,
+                                  NULL,
+                                  feedback,
+                                  destroy_nested_presentation_feedback);
+
+  wl_list_insert (surface->pending_feedback_list.prev, &feedback->link);
+}
+
+static const struct wp_presentation_interface presentation_interface = {
+  presentation_destroy,
+  presentation_feedback
+};
+
+static void
+presentation_bind (struct wl_client *client, void *data, uint32_t version, uint32_t id)
+{
+  struct Compositor *c = compositor_from_client (data, client);
+  struct wl_resource *resource =
+    wl_resource_create (client, &wp_presentation_interface, 1, id);
+  wl_resource_set_implementation (resource, &presentation_interface, c, NULL);
+
+  /* GDK frame clock timings come from g_get_monotonic_time () */
+  wp_presentation_send_clock_id (resource, CLOCK_MONOTONIC);
+}
+
+/* ===== VISIBILITY INTERFACE ====== */
+
+static void
+visibility_destroy (struct wl_client *client, struct wl_resource *resource)
+{
+  wl_resource_destroy (resource);
+}
+
+static const struct nested_visibility_interface visibility_interface = {
+  visibility_destroy
+};
+
+static void
+unbind_visibility (struct wl_resource *resource)
+{
+  wl_list_remove (wl_resource_get_link (resource));
+}
+
+static void
+visibility_bind (struct wl_client *client, void *data, uint32_t version, uint32_t id)
+{
+  struct Compositor *c = compositor_from_client (data, client);
+  struct wl_resource *resource =
+    wl_resource_create (client, &nested_visibility_interface, 1, id);
+  wl_resource_set_implementation (resource, &visibility_interface, c,
+                                  unbind_visibility);
+
+  wl_list_insert (&c->visibility_resource_list,
+                  wl_resource_get_link (resource));
+  nested_visibility_send_state (resource, c->visibility);
+}
+
+/* ===== SCENE ====== */
+
+/* Creates the child display and its globals, for the first compositor.
+   The globals route clients to the compositor of their view */
+static struct Scene *
+scene_create (struct Compositor *c)
+{
+  struct Scene *s = g_new0 (struct Scene, 1);
+  const gchar *extensions;
+
+  s->display = c->display;
+  wl_list_init (&s->compositor_list);
+  g_mutex_init (&s->wl_lock);
+
+  /* Create client child display */
+  s->child_display = wl_display_create ();
+  if (!s->child_display) {
+    log_error (LOG_COMPOSITOR, "failed to create the child display");
+    goto err;
+  }
+  c->child_display = s->child_display;
+
+  /* Register display object */
+  if (!wl_global_create (s->child_display,
+                         &wl_compositor_interface,
+                         wl_compositor_interface.version,
+                         s, compositor_bind)) {
+    log_error (LOG_COMPOSITOR, "failed to bind nested compositor");
+    goto err;
+  }
+
+  if (!wl_global_create (s->child_display,
+                         &wp_presentation_interface, 1,
+                         s, presentation_bind)) {
+    log_error (LOG_COMPOSITOR, "failed to create presentation global");
+    goto err;
+  }
+
+  if (!wl_global_create (s->child_display,
+                         &wp_viewporter_interface, 1,
+                         s, viewporter_bind)) {
+    log_error (LOG_COMPOSITOR, "failed to create viewporter global");
+    goto err;
+  }
+
+  if (!wl_global_create (s->child_display,
+                         &nested_visibility_interface, 1,
+                         s, visibility_bind)) {
+    log_error (LOG_COMPOSITOR, "failed to create visibility global");
+    goto err;
+  }
+
+  wl_display_init_shm (s->child_display);
+
+  create_image = (void *) eglGetProcAddress("eglCreateImageKHR");
+  destroy_image = (void *) eglGetProcAddress("eglDestroyImageKHR");
+  image_target_texture_2d =	(void *) eglGetProcAddress("glEGLImageTargetTexture2DOES");
+
+  /* Bind child display. The extension is deprecated in Mesa, clients
+     are expected to use zwp_linux_dmabuf_v1 instead */
+  EGLDisplay egl_display = s->display->egl_display;
+  extensions = eglQueryString(egl_display, EGL_EXTENSIONS);
+  if (strstr (extensions, "EGL_WL_bind_wayland_display") != NULL) {
+    bind_display = (void *) eglGetProcAddress("eglBindWaylandDisplayWL");
+    unbind_display = (void *) eglGetProcAddress("eglUnbindWaylandDisplayWL");
+    query_buffer = (void *) eglGetProcAddress("eglQueryWaylandBufferWL");
+
+    if (!bind_display (egl_display, s->child_display)) {
+      log_warning (LOG_COMPOSITOR, "failed to bind wl_display");
+      query_buffer = NULL;
+    }
+  } else {
+    log_info (LOG_COMPOSITOR, "no EGL_WL_bind_wayland_display extension");
+  }
+
+  /* buffers only need the EGL display, which all views share */
+  if (linux_dmabuf_init (c) < 0)
+    log_info (LOG_COMPOSITOR, "zwp_linux_dmabuf_v1 unavailable");
+
+  /* Clients are dispatched from the GTK main loop unless asked to use
+     a thread of their own, which is only started once every global is
+     in place */
+  if (g_strcmp0 (g_getenv ("NESTED_DISPATCH_THREAD"), "1") == 0)
+    s->dispatch_thread = compositor_display_thread_new (s->child_display,
+                                                        &s->wl_lock);
+  else
+    compositor_display_source_new (s->child_display);
+
+  log_info (LOG_COMPOSITOR, "nested compositor initialized");
+
+  return s;
+
+ err:
+  /* the globals go with the display */
+  if (s->child_display)
+    wl_display_destroy (s->child_display);
+  c->child_display = NULL;
+  g_mutex_clear (&s->wl_lock);
+  g_free (s);
+  return NULL;
+}
+
+static int
+compositor_init (struct Compositor *c)
+{
+  const gchar *extensions;
+
+  wl_list_init (&c->surface_list);
+  wl_list_init (&c->presentation_list);
+  wl_list_init (&c->visibility_resource_list);
+  pixman_region32_init (&c->opaque_region);
+  c->gl_garbage = g_ptr_array_new_with_free_func ((GDestroyNotify) cairo_surface_destroy);
+  c->gl_garbage_textures = g_array_new (FALSE, FALSE, sizeof (GLuint));
+  c->parent_garbage = g_ptr_array_new_with_free_func ((GDestroyNotify) nested_buffer_free);
+  c->import_frame = -1;
+
+  /* the widget isn't mapped yet */
+  c->visibility = VISIBILITY_HIDDEN;
+
+  /* wl_shm buffers are drawn from the pool memory unless asked to upload
+     them, which needs BGRA textures. The GL renderer can only present
+     contents that are in a texture */
+  c->shm_path = SHM_PATH_CAIRO;
+  if (g_strcmp0 (g_getenv ("NESTED_SHM_PATH"), "gl") == 0 ||
+      g_strcmp0 (g_getenv ("NESTED_RENDERER"), "gl") == 0) {
+    cairo_device_acquire (c->display->egl_device);
+    extensions = (const gchar *) glGetString (GL_EXTENSIONS);
+    cairo_device_release (c->display->egl_device);
+    if (extensions && strstr (extensions, "GL_EXT_texture_format_BGRA8888"))
+      c->shm_path = SHM_PATH_GL;
+    else
+      log_warning (LOG_COMPOSITOR, "no BGRA texture support, drawing shm buffers with cairo");
+  }
+
+  c->passthrough_enabled =
+    g_strcmp0 (g_getenv ("NESTED_PASSTHROUGH"), "1") == 0;
+
+  c->resize_policy = RESIZE_CROP;
+  if (g_strcmp0 (g_getenv ("NESTED_RESIZE_POLICY"), "scale") == 0)
+    c->resize_policy = RESIZE_SCALE;
+  else if (g_strcmp0 (g_getenv ("NESTED_RESIZE_POLICY"), "letterbox") == 0)
+    c->resize_policy = RESIZE_LETTERBOX;
+
+  /* frame callbacks of hidden clients fire once per second unless told
+     otherwise, NESTED_HIDDEN_FPS=0 stops them */
+  c->throttle_interval = 1000;
+  if (g_getenv ("NESTED_HIDDEN_FPS")) {
+    int fps = atoi (g_getenv ("NESTED_HIDDEN_FPS"));
+    c->throttle_interval = fps > 0 ? MAX (1000 / fps, 1) : 0;
+  }
+
+  /* buffers are kept until drawn unless asked to release them early */
+  c->release_policy = BUFFER_RELEASE_ON_DRAW;
+  if (g_strcmp0 (g_getenv ("NESTED_BUFFER_RELEASE"), "early") == 0)
+    c->release_policy = BUFFER_RELEASE_EARLY;
+
+  /* every view of the process shares the child display */
+  if (!scene) {
+    scene = scene_create (c);
+    if (!scene)
+      return -1;
+  }
+
+  c->scene = scene;
+  c->child_display = scene->child_display;
+  c->dispatch_thread = scene->dispatch_thread;
+
+  compositor_lock (c);
+  wl_list_insert (scene->compositor_list.prev, &c->link);
+  compositor_unlock (c);
+
+  return 0;
+}
+
+
+/* Fires the frame callbacks of every surface once the toplevel has
+   painted, with the time of the frame */
+static void
+compositor_frame_done (struct Compositor *c, uint32_t time)
+{
+  struct NestedFrameCallback *nc, *next;
+  struct NestedSurface *surface;
+  gint64 start = timing_begin ();
+
+  wl_list_for_each (surface, &c->surface_list, link) {
+    wl_list_for_each_safe (nc, next, &surface->frame_callback_list, link) {
+      wl_callback_send_done (nc->resource, time);
+      wl_resource_destroy (nc->resource);
+    }
+
+    /* with early release, buffers were released when copied. wl_shm
+       buffers whose pool memory the surface is drawn from are released
+       when replaced, every redraw until then reads it again */
+    if (c->release_policy == BUFFER_RELEASE_ON_DRAW &&
+        surface->buffer_release_pending &&
+        !(surface->buffer->shm_buffer &&
+          surface->cairo_surface == surface->buffer->cairo_surface)) {
+      nested_buffer_release (surface->buffer);
+      surface->buffer_release_pending = FALSE;
+    }
+  }
+
+  wl_display_flush_clients (c->child_display);
+
+  timing_end (TIMING_FRAME_DONE, start);
+}
+
+/* Feedback for contents painted in this frame waits for the timings of
+   the frame to be complete, the ones from previous frames are sent as
+   soon as they are */
+static void
+compositor_update_presentation (struct Compositor *c,
+                                GdkFrameClock *frame_clock)
+{
+  struct NestedPresentationFeedback *feedback, *next;
+  struct NestedSurface *surface;
+  GdkFrameTimings *timings;
+  gint64 frame_counter = gdk_frame_clock_get_frame_counter (frame_clock);
+
+  wl_list_for_each (surface, &c->surface_list, link) {
+    if (c->widget_drawn || c->passthrough_surface == surface) {
+      wl_list_for_each (feedback, &surface->feedback_list, link)
+        feedback->frame_counter = frame_counter;
+      wl_list_insert_list (c->presentation_list.prev,
+                           &surface->feedback_list);
+      wl_list_init (&surface->feedback_list);
+    } else if (!gtk_widget_is_drawable (c->widget)) {
+      discard_feedback_list (&surface->feedback_list);
+    }
+  }
+  c->widget_drawn = FALSE;
+
+  wl_list_for_each_safe (feedback, next, &c->presentation_list, link) {
+    timings = gdk_frame_clock_get_timings (frame_clock,
+                                           feedback->frame_counter);
+    if (timings && !gdk_frame_timings_get_complete (timings))
+      continue;
+
+    send_feedback_presented (feedback, timings);
+  }
+
+  /* timings get completed once the parent compositor has presented the
+     frame, keep the clock going until then */
+  if (!wl_list_empty (&c->presentation_list))
+    gdk_frame_clock_request_phase (frame_clock,
+                                   GDK_FRAME_CLOCK_PHASE_AFTER_PAINT);
+}
+
+/* Feeds the benchmark with the frames that showed new client contents */
+static void
+compositor_bench_frame (struct Compositor *c)
+{
+  struct NestedSurface *surface;
+  gint64 oldest = 0;
+
+  if (!c->widget_drawn && !c->passthrough_surface)
+    return;
+
+  wl_list_for_each (surface, &c->surface_list, link) {
+    if (!surface->commit_time || surface->commit_pending)
+      continue;
+
+    if (!oldest || surface->commit_time < oldest)
+      oldest = surface->commit_time;
+    surface->commit_time = 0;
+  }
+
+  if (oldest)
+    bench_frame (g_get_monotonic_time () - oldest);
+}
+
+static void
+compositor_after_paint (GdkFrameClock *frame_clock, struct Compositor *c)
+{
+  gint64 frame_time = gdk_frame_clock_get_frame_time (frame_clock);
+
+  compositor_lock (c);
+  if (bench_enabled)
+    compositor_bench_frame (c);
+  compositor_update_presentation (c, frame_clock);
+  /* the toplevel may still be painting without us, the throttle timer
+     fires the callbacks then */
+  if (c->visibility == VISIBILITY_VISIBLE)
+    compositor_frame_done (c, frame_time / 1000);
+  compositor_unlock (c);
+}
+
+static gboolean
+compositor_throttle_frame (gpointer data)
+{
+  struct Compositor *c = data;
+
+  compositor_lock (c);
+  compositor_frame_done (c, g_get_monotonic_time () / 1000);
+  compositor_unlock (c);
+
+  return G_SOURCE_CONTINUE;
+}
+
+/* Works out whether the widget can be seen, telling the clients and
+   throttling their frame callbacks when that changes */
+static void
+compositor_update_visibility (struct Compositor *c)
+{
+  struct wl_resource *resource;
+  enum Visibility visibility;
+
+  if (!c->mapped || c->iconified)
+    visibility = VISIBILITY_HIDDEN;
+  else if (c->obscured)
+    visibility = VISIBILITY_OBSCURED;
+  else
+    visibility = VISIBILITY_VISIBLE;
+
+  if (visibility == c->visibility)
+    return;
+
+  log_debug (LOG_COMPOSITOR, "visibility: %d", visibility);
+
+  compositor_lock (c);
+  c->visibility = visibility;
+  wl_resource_for_each (resource, &c->visibility_resource_list)
+    nested_visibility_send_state (resource, visibility);
+  wl_display_flush_clients (c->child_display);
+  compositor_unlock (c);
+
+  if (visibility == VISIBILITY_VISIBLE) {
+    if (c->throttle_source) {
+      g_source_remove (c->throttle_source);
+      c->throttle_source = 0;
+    }
+
+    /* contents committed while hidden were never drawn */
+    gtk_widget_queue_draw (c->widget);
+  } else if (!c->throttle_source && c->throttle_interval) {
+    c->throttle_source =
+      g_timeout_add (c->throttle_interval, compositor_throttle_frame, c);
+  }
+}
+
+/* Applies what the dispatch thread latched since the last time, in one
+   go for all the surfaces */
+static gboolean
+compositor_apply (gpointer data)
+{
+  struct Compositor *c = data;
+  struct NestedSurface *surface;
+
+  /* commits latched from now on schedule another run */
+  g_atomic_int_set (&c->apply_scheduled, FALSE);
+
+  compositor_lock (c);
+
+  if (c->gl_garbage->len || c->gl_garbage_textures->len) {
+    cairo_device_acquire (c->display->egl_device);
+    g_ptr_array_set_size (c->gl_garbage, 0);
+    glDeleteTextures (c->gl_garbage_textures->len,
+                      (GLuint *) c->gl_garbage_textures->data);
+    g_array_set_size (c->gl_garbage_textures, 0);
+    cairo_device_release (c->display->egl_device);
+  }
+
+  g_ptr_array_set_size (c->parent_garbage, 0);
+
+  if (c->surfaces_changed) {
+    gtk_widget_queue_draw (c->widget);
+    compositor_update_size_request (c);
+    compositor_update_opaque_region (c);
+    c->surfaces_changed = FALSE;
+  }
+
+  if (c->passthrough_hide_pending) {
+    if (c->passthrough && !c->passthrough_surface)
+      passthrough_hide (c->passthrough);
+    c->passthrough_hide_pending = FALSE;
+  }
+
+  wl_list_for_each (surface, &c->surface_list, link) {
+    if (surface->commit_pending) {
+      surface->commit_pending = FALSE;
+      surface_apply_commit (surface);
+    }
+  }
+
+  wl_display_flush_clients (c->child_display);
+
+  compositor_unlock (c);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+compositor_schedule_apply (struct Compositor *c)
+{
+  if (g_atomic_int_compare_and_exchange (&c->apply_scheduled, FALSE, TRUE))
+    g_idle_add_full (GDK_PRIORITY_EVENTS, compositor_apply, c, NULL);
+}
+
+/* Serializes access to the child display and the surfaces with the
+   dispatch thread, and is uncontended without one */
+void
+compositor_lock (struct Compositor *c)
+{
+  g_mutex_lock (&c->scene->wl_lock);
+}
+
+void
+compositor_unlock (struct Compositor *c)
+{
+  g_mutex_unlock (&c->scene->wl_lock);
+}
+
+static gboolean
+compositor_widget_draw (GtkWidget *widget, cairo_t *cr, struct Compositor *c)
+{
+  c->widget_drawn = TRUE;
+  return FALSE;
+}
+
+static void
+compositor_widget_realize (GtkWidget *widget, struct Compositor *c)
+{
+  c->frame_clock = gtk_widget_get_frame_clock (widget);
+  c->after_paint_handler =
+    g_signal_connect (c->frame_clock, "after-paint",
+                      G_CALLBACK (compositor_after_paint), c);
+
+  /* the new window doesn't know about the opaque region yet */
+  compositor_lock (c);
+  pixman_region32_clear (&c->opaque_region);
+  compositor_update_opaque_region (c);
+  compositor_unlock (c);
+}
+
+static void
+compositor_toplevel_window_state (GtkWidget *toplevel,
+                                  GdkEventWindowState *event,
+                                  struct Compositor *c)
+{
+  c->iconified = (event->new_window_state & GDK_WINDOW_STATE_ICONIFIED) != 0;
+  compositor_update_visibility (c);
+}
+
+/* Timeouts that would otherwise fire on an unrealized or destroyed
+   widget */
+static void
+compositor_remove_sources (struct Compositor *c)
+{
+  if (c->throttle_source) {
+    g_source_remove (c->throttle_source);
+    c->throttle_source = 0;
+  }
+
+  if (c->resize_source) {
+    g_source_remove (c->resize_source);
+    c->resize_source = 0;
+  }
+}
+
+static void
+compositor_widget_unrealize (GtkWidget *widget, struct Compositor *c)
+{
+  g_signal_handler_disconnect (c->frame_clock, c->after_paint_handler);
+  c->after_paint_handler = 0;
+  c->frame_clock = NULL;
+
+  if (c->toplevel) {
+    g_signal_handler_disconnect (c->toplevel, c->window_state_handler);
+    c->window_state_handler = 0;
+    c->toplevel = NULL;
+  }
+
+  compositor_remove_sources (c);
+}
+
+static void
+compositor_widget_destroy (GtkWidget *widget, struct Compositor *c)
+{
+  compositor_remove_sources (c);
+}
+
+/* Only delivered by some GDK backends, X11 among them */
+static gboolean
+compositor_widget_visibility_notify (GtkWidget *widget,
+                                     GdkEventVisibility *event,
+                                     struct Compositor *c)
+{
+  c->obscured = event->state == GDK_VISIBILITY_FULLY_OBSCURED;
+  compositor_update_visibility (c);
+
+  return FALSE;
+}
+
+static void
+compositor_widget_map (GtkWidget *widget, struct Compositor *c)
+{
+  GtkWidget *toplevel = gtk_widget_get_toplevel (widget);
+  int x, y;
+
+  /* minimizing the window hides the widget without unmapping it */
+  if (toplevel != c->toplevel && gtk_widget_is_toplevel (toplevel)) {
+    if (c->toplevel)
+      g_signal_handler_disconnect (c->toplevel, c->window_state_handler);
+    c->toplevel = toplevel;
+    c->window_state_handler =
+      g_signal_connect (toplevel, "window-state-event",
+                        G_CALLBACK (compositor_toplevel_window_state), c);
+  }
+
+  c->mapped = TRUE;
+  compositor_update_visibility (c);
+
+  if (!c->passthrough_enabled)
+    return;
+
+  c->passthrough = passthrough_create (c, gtk_widget_get_window (widget));
+  if (!c->passthrough) {
+    log_info (LOG_COMPOSITOR, "buffer passthrough unavailable");
+    return;
+  }
+
+  compositor_get_widget_offset (widget, &x, &y);
+  passthrough_set_position (c->passthrough, x, y);
+}
+
+static void
+compositor_widget_unmap (GtkWidget *widget, struct Compositor *c)
+{
+  c->mapped = FALSE;
+  compositor_update_visibility (c);
+
+  if (!c->passthrough)
+    return;
+
+  passthrough_destroy (c->passthrough);
+  c->passthrough = NULL;
+  c->passthrough_surface = NULL;
+}
+
+static void
+compositor_widget_size_allocate (GtkWidget *widget,
+                                 GdkRectangle *allocation,
+                                 struct Compositor *c)
+{
+  int x, y;
+
+  /* surfaces that don't fit are drawn scaled to the new size */
+  if (c->resize_policy != RESIZE_CROP) {
+    compositor_lock (c);
+    compositor_update_opaque_region (c);
+    compositor_unlock (c);
+  }
+
+  if (!c->passthrough)
+    return;
+
+  compositor_get_widget_offset (widget, &x, &y);
+  passthrough_set_position (c->passthrough, x, y);
+}
+
+/* Position of the widget relative to the toplevel wl_surface, which is
+   the origin of the toplevel GdkWindow */
+void
+compositor_get_widget_offset (GtkWidget *widget, int *x, int *y)
+{
+  GdkWindow *window = gtk_widget_get_window (widget);
+  GdkWindow *toplevel = gdk_window_get_effective_toplevel (window);
+  int wx, wy;
+
+  *x = *y = 0;
+  while (window && window != toplevel) {
+    gdk_window_get_position (window, &wx, &wy);
+    *x += wx;
+    *y += wy;
+    window = gdk_window_get_effective_parent (window);
+  }
+}
+
+struct Compositor *
+compositor_create (GtkWidget *widget, struct Display *d)
+{
+  struct Compositor *c = g_new0 (struct Compositor, 1);
+  c->display = d;
+  c->widget = widget;
+
+  if (compositor_init (c) < 0) {
+    log_error (LOG_COMPOSITOR, "failed to create the nested compositor");
+    pixman_region32_fini (&c->opaque_region);
+    g_ptr_array_free (c->gl_garbage, TRUE);
+    g_array_free (c->gl_garbage_textures, TRUE);
+    g_ptr_array_free (c->parent_garbage, TRUE);
+    g_free (c);
+    return NULL;
+  }
+
+  g_signal_connect (widget, "realize",
+                    G_CALLBACK (compositor_widget_realize), c);
+  g_signal_connect (widget, "unrealize",
+                    G_CALLBACK (compositor_widget_unrealize), c);
+  g_signal_connect (widget, "destroy",
+                    G_CALLBACK (compositor_widget_destroy), c);
+  g_signal_connect_after (widget, "draw",
+                          G_CALLBACK (compositor_widget_draw), c);
+  g_signal_connect_after (widget, "map",
+                          G_CALLBACK (compositor_widget_map), c);
+  g_signal_connect (widget, "unmap",
+                    G_CALLBACK (compositor_widget_unmap), c);
+  g_signal_connect_after (widget, "size-allocate",
+                          G_CALLBACK (compositor_widget_size_allocate), c);
+  g_signal_connect (widget, "visibility-notify-event",
+                    G_CALLBACK (compositor_widget_visibility_notify), c);
+
+  return c;
 }
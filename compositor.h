@@ -12,6 +12,7 @@
 #include <GL/glext.h>
 #include <cairo.h>
 #include <cairo-gl.h>
+#include <pixman.h>
 
 struct Display {
   /* GDK display */
@@ -19,31 +20,253 @@ struct Display {
 
   /* Wayland display */
   struct wl_display *wl_display;
+  struct wl_compositor *compositor;
+  struct wl_subcompositor *subcompositor;
+  struct zwp_linux_dmabuf_v1 *dmabuf;
 
   /* EGL display */
   EGLDisplay egl_display;
   EGLConfig egl_config;
   EGLContext egl_ctx;
   cairo_device_t *egl_device;
+
+  /* GDK context of the toplevel, set when egl_ctx is in its share group
+     and the surfaces are drawn with gdk_cairo_draw_from_gl () */
+  GdkGLContext *gl_context;
 };
 
 struct NestedSurface;
+struct NestedDmabufBuffer;
+struct Passthrough;
+struct PassthroughExport;
+struct DisplayThread;
+
+/* How wl_shm buffers get to the screen: either by wrapping the pool
+   memory in a cairo image surface, or by uploading the damaged rows to a
+   GL texture owned by the surface */
+enum ShmPath {
+  SHM_PATH_CAIRO,
+  SHM_PATH_GL
+};
+
+/* When client buffers are handed back. ON_DRAW releases a buffer once
+   the widget has been drawn with it, except wl_shm buffers drawn from
+   the pool memory, which are released when replaced. GPU buffers are
+   still sampled by later redraws then, so a client drawing into a
+   released buffer may show a partial frame until its next commit. EARLY
+   copies every buffer when it is applied and releases it right away,
+   for the cost of the copy */
+enum BufferReleasePolicy {
+  BUFFER_RELEASE_ON_DRAW,
+  BUFFER_RELEASE_EARLY
+};
+
+/* How a surface that doesn't fit in the widget is drawn until the
+   widget has been resized for it: cut at the widget edges, stretched to
+   the widget size, or scaled down keeping its aspect ratio and centered */
+enum ResizePolicy {
+  RESIZE_CROP,
+  RESIZE_SCALE,
+  RESIZE_LETTERBOX
+};
+
+/* Whether the widget can be seen, in the order of the nested_visibility
+   protocol states */
+enum Visibility {
+  VISIBILITY_VISIBLE,
+  VISIBILITY_OBSCURED,
+  VISIBILITY_HIDDEN
+};
+
+/* Child display and GL context shared by the compositors of all the
+   views of the process, so that another view only costs its surfaces.
+   Clients are routed to the compositor of the view they were launched
+   for */
+struct Scene {
+  struct Display *display;
+  struct wl_display *child_display;
+  struct DisplayThread *dispatch_thread;
+  GMutex wl_lock;
+  struct wl_list compositor_list;
+};
 
 struct Compositor {
+  struct Scene *scene;
+  struct wl_list link;
   struct Display *display;
+  enum ShmPath shm_path;
+  enum BufferReleasePolicy release_policy;
   struct wl_display *child_display;
-  struct NestedSurface *nested_surface;
-  struct wl_list frame_callback_list;
+  struct wl_list surface_list;
   GtkWidget *widget;
+
+  /* size last requested for the widget. Requests are at most applied
+     once per resize_source period, surfaces are drawn following
+     resize_policy in between */
+  int request_width, request_height;
+  guint resize_source;
+  enum ResizePolicy resize_policy;
+
+  /* frame callbacks are fired after the widget toplevel has painted */
+  GdkFrameClock *frame_clock;
+  gint64 import_frame;
+  gulong after_paint_handler;
+  gboolean widget_drawn;
+
+  /* presentation feedback waiting for the timings of its frame */
+  struct wl_list presentation_list;
+
+  /* while the widget can't be seen, frame callbacks are fired from a
+     timer every throttle_interval ms instead, or not at all for 0 */
+  enum Visibility visibility;
+  gboolean mapped;
+  gboolean obscured;
+  gboolean iconified;
+  GtkWidget *toplevel;
+  gulong window_state_handler;
+  guint throttle_interval;
+  guint throttle_source;
+  struct wl_list visibility_resource_list;
+
+  /* opaque part of the widget, as last given to GDK */
+  pixman_region32_t opaque_region;
+
+  /* surface whose buffers are forwarded to the parent compositor */
+  gboolean passthrough_enabled;
+  struct Passthrough *passthrough;
+  struct NestedSurface *passthrough_surface;
+
+  /* set when the child display is dispatched on its own thread. Commits
+     are latched there and applied from the GTK thread, and the wl_lock
+     of the scene is held by whichever thread touches the display or the
+     surfaces */
+  struct DisplayThread *dispatch_thread;
+  gint apply_scheduled;
+  gboolean surfaces_changed;
+  gboolean passthrough_hide_pending;
+
+  /* GL objects released from the dispatch thread, which has no context */
+  GPtrArray *gl_garbage;
+  GArray *gl_garbage_textures;
+
+  /* buffers destroyed on the dispatch thread while exported to the
+     parent compositor, whose proxies belong to the GTK thread */
+  GPtrArray *parent_garbage;
+};
+
+/* How the buffer of a surface maps to the surface: the wl_surface buffer
+   scale and transform, then the wp_viewport source rectangle, in surface
+   coordinates of the transformed and scaled buffer, and destination
+   size. src_width and dst_width are -1 while unset */
+struct NestedBufferState {
+  int32_t scale;
+  uint32_t transform;
+  double src_x, src_y, src_width, src_height;
+  int32_t dst_width, dst_height;
 };
 
 struct NestedSurface {
   struct wl_resource *buffer_resource;
   struct Compositor *compositor;
-  EGLImageKHR *image;
-  GLuint texture;
+  struct NestedBuffer *buffer;
+  gboolean buffer_release_pending;
+  pixman_region32_t pending_damage;
+
+  /* state latched by the last commits, waiting to be applied */
+  struct wl_resource *committed_buffer_resource;
+  pixman_region32_t damage;
+  gboolean commit_pending;
+
+  /* buffer of the last applied commit, only imported when the widget
+     draws, until then the previous contents are still shown */
+  struct NestedBuffer *import_buffer;
+
+  /* oldest commit not painted yet, only tracked when benchmarking */
+  gint64 commit_time;
+
+  /* opaque region set by the client, in surface coordinates */
+  pixman_region32_t pending_opaque_region;
+  gboolean pending_opaque_region_set;
+  pixman_region32_t opaque_region;
+
+  /* buffer state set since the last commit, latched by the last commit
+     and applied with it. The size of the surface follows from state and
+     the size of the last applied buffer */
+  struct NestedBufferState pending_state;
+  struct NestedBufferState committed_state;
+  struct NestedBufferState state;
+  int buffer_width, buffer_height;
+  struct wl_resource *viewport;
+
+  struct wl_list pending_frame_callback_list;
+  struct wl_list frame_callback_list;
+  struct wl_list pending_feedback_list;
+  struct wl_list feedback_list;
   struct wl_list link;
   cairo_surface_t *cairo_surface;
+  int width, height;
+
+  /* position in the widget, surfaces are stacked in creation order */
+  int x, y;
+
+  /* copy of the last wl_shm buffer, kept in a texture with SHM_PATH_GL
+     or in an image surface with BUFFER_RELEASE_EARLY */
+  GLuint shm_texture;
+  cairo_surface_t *shm_cairo_surface;
+  int shm_width, shm_height;
+  uint32_t shm_format;
+
+  /* copy of the last GPU buffer with BUFFER_RELEASE_EARLY */
+  GLuint copy_texture;
+  cairo_surface_t *copy_cairo_surface;
+  int copy_width, copy_height;
+
+  /* contents flipped upside down, the way GDK draws textures, when the
+     display shares its context with GDK. They are mapped to the surface
+     at the scale of the widget already. Dirty until the contents of the
+     last commit are in it, which only needs gdk_damage redrawn */
+  GLuint gdk_texture;
+  int gdk_texture_width, gdk_texture_height, gdk_texture_scale;
+  gboolean gdk_texture_dirty;
+  pixman_region32_t gdk_damage;
+};
+
+/* Client buffers are imported once and the result is kept around for as
+   long as the wl_buffer lives, so that clients cycling through a small
+   swapchain don't pay for an EGLImage import on every commit */
+struct NestedBuffer {
+  struct wl_resource *resource;
+  struct wl_listener destroy_listener;
+  struct Compositor *compositor;
+  EGLImageKHR image;
+  GLuint texture;
+  cairo_surface_t *cairo_surface;
+  EGLint format;
+  int width, height;
+
+  /* set for wl_shm buffers, which are never turned into an EGLImage */
+  struct wl_shm_buffer *shm_buffer;
+  void *shm_data;
+
+  /* set for zwp_linux_dmabuf_v1 buffers, whose EGLImage is borrowed */
+  struct NestedDmabufBuffer *dmabuf;
+
+  /* dmabuf export of the buffer given to the parent compositor, the
+     client release waits for the parent to release it */
+  struct wl_buffer *parent_buffer;
+  struct PassthroughExport *parent_export;
+  gboolean parent_export_failed;
+  gboolean parent_busy;
+  gboolean release_deferred;
+
+  /* first attach since the last release, for timing how long the
+     compositor holds the buffer */
+  gint64 hold_start;
+};
+
+struct NestedRegion {
+  struct wl_resource *resource;
+  pixman_region32_t region;
 };
 
 struct NestedFrameCallback {
@@ -51,8 +274,39 @@ struct NestedFrameCallback {
   struct wl_list link;
 };
 
+struct NestedPresentationFeedback {
+  struct wl_resource *resource;
+  struct wl_list link;
+  gint64 frame_counter;
+};
+
 struct Compositor *compositor_create     (GtkWidget *widget, struct Display *);
 
-void               compositor_frame_done (struct Compositor *compositor);
+void               compositor_lock       (struct Compositor *compositor);
+
+void               compositor_unlock     (struct Compositor *compositor);
+
+void               compositor_import_surfaces (struct Compositor *compositor);
+
+void               compositor_add_client (struct Compositor *compositor,
+                                          struct wl_client *client);
+
+void               nested_surface_get_opaque_region (struct NestedSurface *surface,
+                                                     pixman_region32_t *region);
+
+gboolean           nested_surface_get_buffer_matrix (struct NestedSurface *surface,
+                                                     cairo_matrix_t *matrix);
+
+GLuint             nested_surface_get_texture (struct NestedSurface *surface,
+                                               gboolean *opaque);
+
+void               compositor_get_widget_offset (GtkWidget *widget,
+                                                 int *x, int *y);
+
+void               compositor_get_surface_geometry (struct Compositor *compositor,
+                                                    struct NestedSurface *surface,
+                                                    double *x, double *y,
+                                                    double *scale_x,
+                                                    double *scale_y);
 
 #endif
@@ -0,0 +1,474 @@
+#include "gl-renderer.h"
+#include "log.h"
+
+#include <gdk/gdkwayland.h>
+#include <wayland-server.h>
+
+struct GLRenderer {
+  struct Display *display;
+
+  /* subsurface of the toplevel the nested surfaces are presented in */
+  struct wl_surface *surface;
+  struct wl_subsurface *subsurface;
+  struct wl_egl_window *native;
+  EGLSurface egl_surface;
+  int width, height;
+
+  GLuint program;
+  GLint tex_uniform;
+  GLint opaque_uniform;
+};
+
+#define POS 0
+#define TEXCOORD 1
+
+static const char vertex_shader_text[] =
+  "attribute vec2 pos;\n"
+  "attribute vec2 texcoord;\n"
+  "varying vec2 v_texcoord;\n"
+  "void main() {\n"
+  "  gl_Position = vec4(pos, 0.0, 1.0);\n"
+  "  v_texcoord = texcoord;\n"
+  "}\n";
+
+static const char fragment_shader_text[] =
+  "precision mediump float;\n"
+  "uniform sampler2D tex;\n"
+  "uniform float opaque;\n"
+  "varying vec2 v_texcoord;\n"
+  "void main() {\n"
+  "  vec4 color = texture2D(tex, v_texcoord);\n"
+  "  gl_FragColor = vec4(color.rgb, max(color.a, opaque));\n"
+  "}\n";
+
+static GLuint
+create_shader (const char *source, GLenum shader_type)
+{
+  GLuint shader;
+  GLint status;
+
+  shader = glCreateShader (shader_type);
+  glShaderSource (shader, 1, &source, NULL);
+  glCompileShader (shader);
+
+  glGetShaderiv (shader, GL_COMPILE_STATUS, &status);
+  if (!status) {
+    char log[1000];
+    GLsizei len;
+    glGetShaderInfoLog (shader, 1000, &len, log);
+    log_error (LOG_GL_RENDERER, "compiling %s shader: %.*s",
+               shader_type == GL_VERTEX_SHADER ? "vertex" : "fragment",
+               len, log);
+    glDeleteShader (shader);
+    return 0;
+  }
+
+  return shader;
+}
+
+static GLuint
+create_program (void)
+{
+  GLuint program, vert, frag;
+  GLint status;
+
+  vert = create_shader (vertex_shader_text, GL_VERTEX_SHADER);
+  frag = create_shader (fragment_shader_text, GL_FRAGMENT_SHADER);
+  if (!vert || !frag)
+    return 0;
+
+  program = glCreateProgram ();
+  glAttachShader (program, vert);
+  glAttachShader (program, frag);
+  glBindAttribLocation (program, POS, "pos");
+  glBindAttribLocation (program, TEXCOORD, "texcoord");
+  glLinkProgram (program);
+
+  glDeleteShader (vert);
+  glDeleteShader (frag);
+
+  glGetProgramiv (program, GL_LINK_STATUS, &status);
+  if (!status) {
+    char log[1000];
+    GLsizei len;
+    glGetProgramInfoLog (program, 1000, &len, log);
+    log_error (LOG_GL_RENDERER, "linking: %.*s", len, log);
+    glDeleteProgram (program);
+    return 0;
+  }
+
+  return program;
+}
+
+struct GLRenderer *
+gl_renderer_create (struct Display *d, GdkWindow *window)
+{
+  struct GLRenderer *r;
+  struct wl_surface *parent;
+  struct wl_region *region;
+
+  if (!d->compositor || !d->subcompositor) {
+    log_info (LOG_GL_RENDERER, "parent compositor has no wl_subcompositor");
+    return NULL;
+  }
+
+  parent =
+    gdk_wayland_window_get_wl_surface (gdk_window_get_effective_toplevel (window));
+  if (!parent) {
+    log_info (LOG_GL_RENDERER, "toplevel has no wl_surface");
+    return NULL;
+  }
+
+  r = g_new0 (struct GLRenderer, 1);
+  r->display = d;
+  r->width = MAX (gdk_window_get_width (window), 1);
+  r->height = MAX (gdk_window_get_height (window), 1);
+
+  r->surface = wl_compositor_create_surface (d->compositor);
+  r->subsurface = wl_subcompositor_get_subsurface (d->subcompositor,
+                                                   r->surface, parent);
+
+  /* contents are presented as soon as they are swapped, and input keeps
+     going to the GTK window underneath */
+  wl_subsurface_set_desync (r->subsurface);
+  region = wl_compositor_create_region (d->compositor);
+  wl_surface_set_input_region (r->surface, region);
+  wl_region_destroy (region);
+
+  r->native = wl_egl_window_create (r->surface, r->width, r->height);
+  r->egl_surface = eglCreateWindowSurface (d->egl_display, d->egl_config,
+                                           r->native, NULL);
+  if (r->egl_surface == EGL_NO_SURFACE) {
+    log_error (LOG_GL_RENDERER, "failed to create EGL surface");
+    gl_renderer_destroy (r);
+    return NULL;
+  }
+
+  return r;
+}
+
+void
+gl_renderer_destroy (struct GLRenderer *r)
+{
+  struct Display *d = r->display;
+
+  if (r->program) {
+    cairo_device_acquire (d->egl_device);
+    glDeleteProgram (r->program);
+    cairo_device_release (d->egl_device);
+  }
+
+  if (r->egl_surface != EGL_NO_SURFACE)
+    eglDestroySurface (d->egl_display, r->egl_surface);
+  if (r->native)
+    wl_egl_window_destroy (r->native);
+
+  wl_subsurface_destroy (r->subsurface);
+  wl_surface_destroy (r->surface);
+
+  g_free (r);
+}
+
+void
+gl_renderer_set_geometry (struct GLRenderer *r,
+                          int x, int y, int width, int height)
+{
+  /* the position is applied with the next commit of the toplevel */
+  wl_subsurface_set_position (r->subsurface, x, y);
+
+  width = MAX (width, 1);
+  height = MAX (height, 1);
+  if (width == r->width && height == r->height)
+    return;
+
+  wl_egl_window_resize (r->native, width, height, 0, 0);
+  r->width = width;
+  r->height = height;
+}
+
+/* Texture coordinates of the top left, top right, bottom left and bottom
+   right corners of the surface. Returns whether the buffer is scaled,
+   transformed or cropped on the way */
+static gboolean
+get_texcoords (struct NestedSurface *surface, GLfloat texcoords[4][2])
+{
+  cairo_matrix_t matrix;
+  gboolean mapped;
+  double x, y;
+  int i;
+
+  mapped = nested_surface_get_buffer_matrix (surface, &matrix);
+
+  for (i = 0; i < 4; i++) {
+    x = i & 1 ? surface->width : 0;
+    y = i & 2 ? surface->height : 0;
+    cairo_matrix_transform_point (&matrix, &x, &y);
+    texcoords[i][0] = x / surface->buffer_width;
+    texcoords[i][1] = y / surface->buffer_height;
+  }
+
+  return mapped;
+}
+
+static void
+render_surface (struct GLRenderer *r, struct NestedSurface *surface)
+{
+  GLfloat texcoords[4][2];
+  GLfloat verts[4][2];
+  GLfloat x1, y1, x2, y2;
+  double x, y, scale_x, scale_y;
+  gboolean opaque = FALSE, mapped;
+  pixman_region32_t opaque_region;
+  pixman_box32_t box;
+  GLuint texture;
+  GLint filter;
+
+  texture = nested_surface_get_texture (surface, &opaque);
+  if (!texture)
+    return;
+
+  mapped = get_texcoords (surface, texcoords);
+
+  /* a surface declared opaque all over replaces what is below it, so
+     there is nothing to blend */
+  if (!opaque) {
+    nested_surface_get_opaque_region (surface, &opaque_region);
+    box.x1 = 0;
+    box.y1 = 0;
+    box.x2 = surface->width;
+    box.y2 = surface->height;
+    opaque = pixman_region32_contains_rectangle (&opaque_region, &box) ==
+      PIXMAN_REGION_IN;
+    pixman_region32_fini (&opaque_region);
+  }
+
+  compositor_get_surface_geometry (surface->compositor, surface,
+                                   &x, &y, &scale_x, &scale_y);
+
+  /* from widget coordinates to clip space, y pointing up */
+  x1 = 2.0f * x / r->width - 1.0f;
+  x2 = 2.0f * (x + surface->width * scale_x) / r->width - 1.0f;
+  y1 = 1.0f - 2.0f * y / r->height;
+  y2 = 1.0f - 2.0f * (y + surface->height * scale_y) / r->height;
+
+  verts[0][0] = x1; verts[0][1] = y1;
+  verts[1][0] = x2; verts[1][1] = y1;
+  verts[2][0] = x1; verts[2][1] = y2;
+  verts[3][0] = x2; verts[3][1] = y2;
+
+  glActiveTexture (GL_TEXTURE0);
+  glBindTexture (GL_TEXTURE_2D, texture);
+  /* cairo sets the filter it needs before each of its draws too */
+  filter = mapped || scale_x != 1.0 || scale_y != 1.0 ? GL_LINEAR : GL_NEAREST;
+  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+  glUniform1i (r->tex_uniform, 0);
+  glUniform1f (r->opaque_uniform, opaque ? 1.0f : 0.0f);
+
+  glVertexAttribPointer (POS, 2, GL_FLOAT, GL_FALSE, 0, verts);
+  glVertexAttribPointer (TEXCOORD, 2, GL_FLOAT, GL_FALSE, 0, texcoords);
+
+  if (opaque)
+    glDisable (GL_BLEND);
+
+  glDrawArrays (GL_TRIANGLE_STRIP, 0, 4);
+
+  if (opaque)
+    glEnable (GL_BLEND);
+}
+
+void
+gl_renderer_render (struct GLRenderer *r, struct Compositor *c)
+{
+  struct Display *d = r->display;
+  struct NestedSurface *surface;
+  EGLSurface draw_surface, read_surface;
+  EGLContext ctx;
+
+  /* the textures of the compositor live in the cairo device context,
+     which is the one we render with */
+  cairo_device_flush (d->egl_device);
+  cairo_device_acquire (d->egl_device);
+
+  draw_surface = eglGetCurrentSurface (EGL_DRAW);
+  read_surface = eglGetCurrentSurface (EGL_READ);
+  ctx = eglGetCurrentContext ();
+
+  eglMakeCurrent (d->egl_display, r->egl_surface, r->egl_surface, d->egl_ctx);
+
+  if (!r->program) {
+    r->program = create_program ();
+    if (!r->program)
+      goto out;
+    r->tex_uniform = glGetUniformLocation (r->program, "tex");
+    r->opaque_uniform = glGetUniformLocation (r->program, "opaque");
+
+    /* the GTK frame clock already paces us */
+    eglSwapInterval (d->egl_display, 0);
+  }
+
+  glViewport (0, 0, r->width, r->height);
+  glClearColor (0.0, 0.0, 0.0, 0.0);
+  glClear (GL_COLOR_BUFFER_BIT);
+
+  glUseProgram (r->program);
+  glEnable (GL_BLEND);
+  glBlendFunc (GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+  glEnableVertexAttribArray (POS);
+  glEnableVertexAttribArray (TEXCOORD);
+
+  wl_list_for_each (surface, &c->surface_list, link)
+    render_surface (r, surface);
+
+  glDisableVertexAttribArray (POS);
+  glDisableVertexAttribArray (TEXCOORD);
+  glDisable (GL_BLEND);
+
+  eglSwapBuffers (d->egl_display, r->egl_surface);
+
+ out:
+  eglMakeCurrent (d->egl_display, draw_surface, read_surface, ctx);
+  cairo_device_release (d->egl_device);
+}
+
+/* GDK draws textures with their first row at the bottom, the GL way,
+   while client buffers have it at the top. The contents are flipped once
+   per commit into a texture of the share group, which GDK composites
+   without reading it back. Buffers shown scaled go through the same
+   pass, so that is where they get scaled. Only the damage of the
+   commits since the last pass is redrawn, unless the texture is new */
+static GLuint flip_program;
+static GLint flip_tex_uniform, flip_opaque_uniform;
+static GLuint flip_fbo;
+
+static void
+update_gdk_texture (struct NestedSurface *surface, int scale)
+{
+  static const GLfloat verts[4][2] = {
+    { -1, 1 }, { 1, 1 }, { -1, -1 }, { 1, -1 }
+  };
+  GLfloat texcoords[4][2];
+  gboolean opaque = FALSE;
+  int width = surface->width * scale;
+  int height = surface->height * scale;
+  pixman_box32_t *extents;
+  GLuint texture;
+  GLint filter;
+
+  /* contents in an image surface are drawn through cairo, and the whole
+     texture is stale once they are back in one */
+  texture = nested_surface_get_texture (surface, &opaque);
+  if (!texture) {
+    pixman_region32_union_rect (&surface->gdk_damage, &surface->gdk_damage,
+                                0, 0, surface->width, surface->height);
+    return;
+  }
+
+  filter = get_texcoords (surface, texcoords) || scale != 1 ?
+    GL_LINEAR : GL_NEAREST;
+
+  if (!surface->gdk_texture) {
+    glGenTextures (1, &surface->gdk_texture);
+    glBindTexture (GL_TEXTURE_2D, surface->gdk_texture);
+    glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  }
+
+  glBindTexture (GL_TEXTURE_2D, surface->gdk_texture);
+  if (surface->gdk_texture_width != width ||
+      surface->gdk_texture_height != height ||
+      surface->gdk_texture_scale != scale) {
+    glTexImage2D (GL_TEXTURE_2D, 0, GL_RGBA, width, height,
+                  0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    surface->gdk_texture_width = width;
+    surface->gdk_texture_height = height;
+    pixman_region32_union_rect (&surface->gdk_damage, &surface->gdk_damage,
+                                0, 0, surface->width, surface->height);
+  }
+  surface->gdk_texture_scale = scale;
+
+  pixman_region32_intersect_rect (&surface->gdk_damage, &surface->gdk_damage,
+                                  0, 0, surface->width, surface->height);
+  extents = pixman_region32_extents (&surface->gdk_damage);
+
+  glFramebufferTexture2D (GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                          GL_TEXTURE_2D, surface->gdk_texture, 0);
+  glViewport (0, 0, width, height);
+
+  /* surface rows are stored bottom up */
+  glScissor (extents->x1 * scale, height - extents->y2 * scale,
+             (extents->x2 - extents->x1) * scale,
+             (extents->y2 - extents->y1) * scale);
+
+  glBindTexture (GL_TEXTURE_2D, texture);
+  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+  glUniform1i (flip_tex_uniform, 0);
+  glUniform1f (flip_opaque_uniform, opaque ? 1.0f : 0.0f);
+
+  glVertexAttribPointer (POS, 2, GL_FLOAT, GL_FALSE, 0, verts);
+  glVertexAttribPointer (TEXCOORD, 2, GL_FLOAT, GL_FALSE, 0, texcoords);
+  if (pixman_region32_not_empty (&surface->gdk_damage))
+    glDrawArrays (GL_TRIANGLE_STRIP, 0, 4);
+
+  pixman_region32_clear (&surface->gdk_damage);
+  surface->gdk_texture_dirty = FALSE;
+}
+
+void
+gl_renderer_update_gdk_textures (struct Display *d, struct Compositor *c)
+{
+  struct NestedSurface *surface;
+  gboolean dirty = FALSE, opaque;
+  GLint framebuffer;
+
+  if (!d->gl_context)
+    return;
+
+  wl_list_for_each (surface, &c->surface_list, link)
+    dirty = dirty || (surface->gdk_texture_dirty &&
+                      nested_surface_get_texture (surface, &opaque));
+  if (!dirty)
+    return;
+
+  cairo_device_flush (d->egl_device);
+  cairo_device_acquire (d->egl_device);
+
+  if (!flip_program) {
+    flip_program = create_program ();
+    if (!flip_program)
+      goto out;
+    flip_tex_uniform = glGetUniformLocation (flip_program, "tex");
+    flip_opaque_uniform = glGetUniformLocation (flip_program, "opaque");
+    glGenFramebuffers (1, &flip_fbo);
+  }
+
+  glGetIntegerv (GL_FRAMEBUFFER_BINDING, &framebuffer);
+  glBindFramebuffer (GL_FRAMEBUFFER, flip_fbo);
+
+  glUseProgram (flip_program);
+  glDisable (GL_BLEND);
+  glEnable (GL_SCISSOR_TEST);
+  glActiveTexture (GL_TEXTURE0);
+  glEnableVertexAttribArray (POS);
+  glEnableVertexAttribArray (TEXCOORD);
+
+  /* HiDPI windows get textures at their pixel size */
+  wl_list_for_each (surface, &c->surface_list, link)
+    if (surface->gdk_texture_dirty && surface->width > 0 &&
+        surface->height > 0)
+      update_gdk_texture (surface, gtk_widget_get_scale_factor (c->widget));
+
+  glDisableVertexAttribArray (POS);
+  glDisableVertexAttribArray (TEXCOORD);
+  glDisable (GL_SCISSOR_TEST);
+  glBindFramebuffer (GL_FRAMEBUFFER, framebuffer);
+
+  /* GDK samples the textures from its own context */
+  glFlush ();
+
+ out:
+  cairo_device_release (d->egl_device);
+}
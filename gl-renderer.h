@@ -0,0 +1,29 @@
+#ifndef __GL_RENDERER_H__
+#define __GL_RENDERER_H__
+
+#include "compositor.h"
+
+/* Presents the nested surfaces directly with GL, drawing textured quads
+   into an EGL window surface that lives in a subsurface of the toplevel,
+   instead of compositing them through cairo into the GTK window */
+struct GLRenderer;
+
+struct GLRenderer *gl_renderer_create       (struct Display *display,
+                                             GdkWindow *window);
+
+void               gl_renderer_destroy      (struct GLRenderer *renderer);
+
+void               gl_renderer_set_geometry (struct GLRenderer *renderer,
+                                             int x, int y,
+                                             int width, int height);
+
+void               gl_renderer_render       (struct GLRenderer *renderer,
+                                             struct Compositor *compositor);
+
+/* Brings the textures GDK draws the surfaces of compositor from up to
+   date with their contents, when the context of display shares them
+   with GDK */
+void               gl_renderer_update_gdk_textures (struct Display *display,
+                                                    struct Compositor *compositor);
+
+#endif
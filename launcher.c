@@ -0,0 +1,361 @@
+#include "launcher.h"
+#include "log.h"
+
+#include <wayland-server.h>
+#include <glib-unix.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* where the client finds its end of the sockets */
+#define CLIENT_SOCKET_FD 3
+#define CLIENT_CONTROL_FD 4
+
+/* Owned by the exit watch of its process from the moment the process is
+   spawned: launcher_client_exited () is the only place one is freed */
+struct LauncherClient {
+  struct Launcher *launcher;
+  pid_t pid;
+
+  /* connection of the client, until it goes away */
+  struct wl_client *client;
+  struct wl_listener destroy_listener;
+
+  /* pooled clients wait for a byte on this socket before showing
+     anything, -1 once handed out */
+  int control_fd;
+  gboolean pooled;
+
+  /* process exit notification, from a pidfd when the kernel has them */
+  int pidfd;
+};
+
+struct Launcher {
+  struct Compositor *compositor;
+  char *path;
+  char **args;
+
+  /* clients started ahead of time, oldest first */
+  int pool_size;
+  GQueue pool;
+  guint refill_source;
+};
+
+static int
+launcher_pidfd_open (pid_t pid)
+{
+#ifdef SYS_pidfd_open
+  return syscall (SYS_pidfd_open, pid, 0);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+static void
+launcher_client_close_control (struct LauncherClient *lc)
+{
+  if (lc->control_fd >= 0)
+    close (lc->control_fd);
+  lc->control_fd = -1;
+}
+
+/* The connection of a client went away, which destroyed its surfaces
+   and buffers along with it */
+static void
+launcher_client_destroyed (struct wl_listener *listener, void *data)
+{
+  struct LauncherClient *lc =
+    wl_container_of (listener, lc, destroy_listener);
+
+  lc->client = NULL;
+
+  if (lc->pooled) {
+    log_warning (LOG_LAUNCHER, "pooled client %d exited before being used",
+                 lc->pid);
+    g_queue_remove (&lc->launcher->pool, lc);
+    lc->pooled = FALSE;
+  }
+
+  launcher_client_close_control (lc);
+}
+
+/* A client process is gone. Its connection is torn down right away, a
+   crashed client may have left it open in a child of its own */
+static void
+launcher_client_exited (struct LauncherClient *lc, int status)
+{
+  struct Compositor *c = lc->launcher->compositor;
+
+  if (WIFSIGNALED (status))
+    log_warning (LOG_LAUNCHER, "client %d killed by signal %d",
+                 lc->pid, WTERMSIG (status));
+  else if (WEXITSTATUS (status) != 0)
+    log_warning (LOG_LAUNCHER, "client %d exited with status %d",
+                 lc->pid, WEXITSTATUS (status));
+  else
+    log_debug (LOG_LAUNCHER, "client %d exited", lc->pid);
+
+  compositor_lock (c);
+  if (lc->client)
+    wl_client_destroy (lc->client);
+  compositor_unlock (c);
+
+  launcher_client_close_control (lc);
+  if (lc->pidfd >= 0)
+    close (lc->pidfd);
+  g_free (lc);
+}
+
+static gboolean
+launcher_pidfd_ready (gint fd, GIOCondition condition, gpointer data)
+{
+  struct LauncherClient *lc = data;
+  int status = 0;
+
+  while (waitpid (lc->pid, &status, 0) < 0 && errno == EINTR)
+    ;
+
+  launcher_client_exited (lc, status);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+launcher_child_watch (GPid pid, gint status, gpointer data)
+{
+  g_spawn_close_pid (pid);
+  launcher_client_exited (data, status);
+}
+
+/* Moves fd above the numbers the sockets get in the client, so that
+   duplicating one there never overwrites the other */
+static int
+launcher_move_fd (int fd)
+{
+  int moved;
+
+  if (fd > CLIENT_CONTROL_FD)
+    return fd;
+
+  moved = fcntl (fd, F_DUPFD_CLOEXEC, CLIENT_CONTROL_FD + 1);
+  close (fd);
+
+  return moved;
+}
+
+/* Spawns a client with WAYLAND_SOCKET set to one end of a socket pair,
+   the other end becoming its wl_client. posix_spawn () doesn't copy the
+   address space of the UI process, and the exit of the client is
+   watched from the main loop. Failures are reported and leave the UI
+   running */
+static struct LauncherClient *
+launcher_spawn (struct Launcher *l, gboolean pooled)
+{
+  struct LauncherClient *lc;
+  posix_spawn_file_actions_t actions;
+  int sv[2] = { -1, -1 }, control[2] = { -1, -1 };
+  char control_arg[16];
+  GPtrArray *argv;
+  char **envp;
+  pid_t pid;
+  int i, ret;
+
+  if (socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0 ||
+      (pooled &&
+       socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, control) < 0)) {
+    log_warning (LOG_LAUNCHER, "socketpair failed while launching '%s': %s",
+                 l->path, g_strerror (errno));
+    goto err_sockets;
+  }
+
+  sv[1] = launcher_move_fd (sv[1]);
+  if (pooled)
+    control[1] = launcher_move_fd (control[1]);
+  if (sv[1] < 0 || (pooled && control[1] < 0)) {
+    log_warning (LOG_LAUNCHER, "fcntl failed while launching '%s': %s",
+                 l->path, g_strerror (errno));
+    goto err_sockets;
+  }
+
+  /* the duplicates don't get closed on exec */
+  posix_spawn_file_actions_init (&actions);
+  posix_spawn_file_actions_adddup2 (&actions, sv[1], CLIENT_SOCKET_FD);
+  if (pooled)
+    posix_spawn_file_actions_adddup2 (&actions, control[1], CLIENT_CONTROL_FD);
+
+  argv = g_ptr_array_new ();
+  g_ptr_array_add (argv, l->path);
+  if (pooled) {
+    g_snprintf (control_arg, sizeof control_arg, "%d", CLIENT_CONTROL_FD);
+    g_ptr_array_add (argv, "--pooled");
+    g_ptr_array_add (argv, control_arg);
+  }
+  for (i = 0; l->args && l->args[i]; i++)
+    g_ptr_array_add (argv, l->args[i]);
+  g_ptr_array_add (argv, NULL);
+
+  envp = g_environ_setenv (g_get_environ (), "WAYLAND_SOCKET",
+                           G_STRINGIFY (CLIENT_SOCKET_FD), TRUE);
+
+  ret = posix_spawn (&pid, l->path, &actions, NULL,
+                     (char **) argv->pdata, envp);
+
+  g_strfreev (envp);
+  g_ptr_array_free (argv, TRUE);
+  posix_spawn_file_actions_destroy (&actions);
+  close (sv[1]);
+  if (pooled)
+    close (control[1]);
+
+  if (ret != 0) {
+    log_warning (LOG_LAUNCHER, "spawning '%s' failed: %s",
+                 l->path, g_strerror (ret));
+    close (sv[0]);
+    if (pooled)
+      close (control[0]);
+    return NULL;
+  }
+
+  lc = g_new0 (struct LauncherClient, 1);
+  lc->launcher = l;
+  lc->pid = pid;
+  lc->control_fd = control[0];
+
+  lc->pidfd = launcher_pidfd_open (pid);
+  if (lc->pidfd >= 0)
+    g_unix_fd_add (lc->pidfd, G_IO_IN, launcher_pidfd_ready, lc);
+  else
+    g_child_watch_add (pid, launcher_child_watch, lc);
+
+  compositor_lock (l->compositor);
+  lc->client = wl_client_create (l->compositor->child_display, sv[0]);
+  if (lc->client) {
+    compositor_add_client (l->compositor, lc->client);
+    lc->destroy_listener.notify = launcher_client_destroyed;
+    wl_client_add_destroy_listener (lc->client, &lc->destroy_listener);
+    if (pooled) {
+      lc->pooled = TRUE;
+      g_queue_push_tail (&l->pool, lc);
+    }
+  }
+  compositor_unlock (l->compositor);
+
+  /* the rest of lc is torn down when the exit watch sees the process go */
+  if (!lc->client) {
+    log_warning (LOG_LAUNCHER, "wl_client_create failed while launching '%s'",
+                 l->path);
+    close (sv[0]);
+    kill (pid, SIGTERM);
+    return NULL;
+  }
+
+  log_debug (LOG_LAUNCHER, "started %sclient %d", pooled ? "pooled " : "", pid);
+
+  return lc;
+
+ err_sockets:
+  for (i = 0; i < 2; i++) {
+    if (sv[i] >= 0)
+      close (sv[i]);
+    if (control[i] >= 0)
+      close (control[i]);
+  }
+  return NULL;
+}
+
+/* Starts one pooled client per main loop iteration, at low priority so
+   that painting comes first, until the pool is full */
+static gboolean
+launcher_refill (gpointer data)
+{
+  struct Launcher *l = data;
+  gboolean full;
+
+  /* the pool is shared with the dispatch thread */
+  compositor_lock (l->compositor);
+  full = g_queue_get_length (&l->pool) >= l->pool_size;
+  compositor_unlock (l->compositor);
+
+  if (full)
+    goto done;
+
+  /* retried with the next launch */
+  if (!launcher_spawn (l, TRUE))
+    goto done;
+
+  return G_SOURCE_CONTINUE;
+
+ done:
+  l->refill_source = 0;
+  return G_SOURCE_REMOVE;
+}
+
+static void
+launcher_schedule_refill (struct Launcher *l)
+{
+  if (l->pool_size > 0 && !l->refill_source)
+    l->refill_source = g_idle_add_full (G_PRIORITY_LOW, launcher_refill,
+                                        l, NULL);
+}
+
+/* Shows a new client, from the pool when there is one ready */
+gboolean
+launcher_launch (struct Launcher *l)
+{
+  struct LauncherClient *lc;
+  gboolean launched = FALSE;
+  int control_fd;
+
+  while (!launched) {
+    compositor_lock (l->compositor);
+    lc = g_queue_pop_head (&l->pool);
+    if (lc) {
+      lc->pooled = FALSE;
+      control_fd = lc->control_fd;
+      lc->control_fd = -1;
+    }
+    compositor_unlock (l->compositor);
+
+    if (!lc)
+      break;
+
+    /* the client may have died since the exit watch last ran */
+    launched = send (control_fd, "", 1, MSG_NOSIGNAL) == 1;
+    if (launched)
+      log_debug (LOG_LAUNCHER, "handed out pooled client %d", lc->pid);
+    else
+      log_warning (LOG_LAUNCHER, "pooled client %d is gone: %s",
+                   lc->pid, g_strerror (errno));
+    close (control_fd);
+  }
+
+  if (!launched)
+    launched = launcher_spawn (l, FALSE) != NULL;
+
+  launcher_schedule_refill (l);
+
+  return launched;
+}
+
+struct Launcher *
+launcher_new (struct Compositor *compositor, const char *path, char **args,
+              int pool_size)
+{
+  struct Launcher *l = g_new0 (struct Launcher, 1);
+
+  l->compositor = compositor;
+  l->path = g_strdup (path);
+  l->args = g_strdupv (args);
+  l->pool_size = MAX (pool_size, 0);
+  g_queue_init (&l->pool);
+
+  launcher_schedule_refill (l);
+
+  return l;
+}
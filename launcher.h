@@ -0,0 +1,18 @@
+#ifndef __LAUNCHER_H__
+#define __LAUNCHER_H__
+
+#include "compositor.h"
+
+/* Spawns clients connected to the child display of a compositor, and
+   tears their connection down when their process exits. Up to
+   pool_size of them are started ahead of time and wait, connected and
+   with EGL initialized, to be handed out by launcher_launch () */
+struct Launcher;
+
+struct Launcher *launcher_new    (struct Compositor *compositor,
+                                  const char *path, char **args,
+                                  int pool_size);
+
+gboolean         launcher_launch (struct Launcher *launcher);
+
+#endif
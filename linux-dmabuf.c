@@ -0,0 +1,481 @@
+#include "linux-dmabuf.h"
+#include "log.h"
+#include "linux-dmabuf-unstable-v1-server-protocol.h"
+
+#include <wayland-server.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifndef DRM_FORMAT_MOD_INVALID
+#define DRM_FORMAT_MOD_INVALID ((1ULL << 56) - 1)
+#endif
+
+#define fourcc_code(a, b, c, d) ((uint32_t)(a) | ((uint32_t)(b) << 8) | \
+                                 ((uint32_t)(c) << 16) | ((uint32_t)(d) << 24))
+
+/* EGL functions */
+static PFNEGLCREATEIMAGEKHRPROC create_image;
+static PFNEGLDESTROYIMAGEKHRPROC destroy_image;
+static PFNEGLQUERYDMABUFFORMATSEXTPROC query_dmabuf_formats;
+static PFNEGLQUERYDMABUFMODIFIERSEXTPROC query_dmabuf_modifiers;
+
+static const EGLint plane_fd_attribs[MAX_DMABUF_PLANES] = {
+  EGL_DMA_BUF_PLANE0_FD_EXT, EGL_DMA_BUF_PLANE1_FD_EXT,
+  EGL_DMA_BUF_PLANE2_FD_EXT, EGL_DMA_BUF_PLANE3_FD_EXT
+};
+static const EGLint plane_offset_attribs[MAX_DMABUF_PLANES] = {
+  EGL_DMA_BUF_PLANE0_OFFSET_EXT, EGL_DMA_BUF_PLANE1_OFFSET_EXT,
+  EGL_DMA_BUF_PLANE2_OFFSET_EXT, EGL_DMA_BUF_PLANE3_OFFSET_EXT
+};
+static const EGLint plane_pitch_attribs[MAX_DMABUF_PLANES] = {
+  EGL_DMA_BUF_PLANE0_PITCH_EXT, EGL_DMA_BUF_PLANE1_PITCH_EXT,
+  EGL_DMA_BUF_PLANE2_PITCH_EXT, EGL_DMA_BUF_PLANE3_PITCH_EXT
+};
+static const EGLint plane_modifier_lo_attribs[MAX_DMABUF_PLANES] = {
+  EGL_DMA_BUF_PLANE0_MODIFIER_LO_EXT, EGL_DMA_BUF_PLANE1_MODIFIER_LO_EXT,
+  EGL_DMA_BUF_PLANE2_MODIFIER_LO_EXT, EGL_DMA_BUF_PLANE3_MODIFIER_LO_EXT
+};
+static const EGLint plane_modifier_hi_attribs[MAX_DMABUF_PLANES] = {
+  EGL_DMA_BUF_PLANE0_MODIFIER_HI_EXT, EGL_DMA_BUF_PLANE1_MODIFIER_HI_EXT,
+  EGL_DMA_BUF_PLANE2_MODIFIER_HI_EXT, EGL_DMA_BUF_PLANE3_MODIFIER_HI_EXT
+};
+
+static gboolean has_modifiers;
+
+/* ===== DMABUF IMPORT ====== */
+
+static EGLImageKHR
+import_dmabuf (struct NestedDmabufBuffer *buffer)
+{
+  EGLint attribs[6 + 10 * MAX_DMABUF_PLANES + 1];
+  int i, n = 0;
+
+  attribs[n++] = EGL_WIDTH;
+  attribs[n++] = buffer->width;
+  attribs[n++] = EGL_HEIGHT;
+  attribs[n++] = buffer->height;
+  attribs[n++] = EGL_LINUX_DRM_FOURCC_EXT;
+  attribs[n++] = buffer->format;
+
+  for (i = 0; i < buffer->n_planes; i++) {
+    attribs[n++] = plane_fd_attribs[i];
+    attribs[n++] = buffer->fd[i];
+    attribs[n++] = plane_offset_attribs[i];
+    attribs[n++] = buffer->offset[i];
+    attribs[n++] = plane_pitch_attribs[i];
+    attribs[n++] = buffer->stride[i];
+
+    if (has_modifiers && buffer->modifier[i] != DRM_FORMAT_MOD_INVALID) {
+      attribs[n++] = plane_modifier_lo_attribs[i];
+      attribs[n++] = buffer->modifier[i] & 0xffffffff;
+      attribs[n++] = plane_modifier_hi_attribs[i];
+      attribs[n++] = buffer->modifier[i] >> 32;
+    }
+  }
+
+  attribs[n++] = EGL_NONE;
+
+  return create_image (buffer->display->egl_display, EGL_NO_CONTEXT,
+                       EGL_LINUX_DMA_BUF_EXT, NULL, attribs);
+}
+
+static void
+nested_dmabuf_buffer_free (struct NestedDmabufBuffer *buffer)
+{
+  int i;
+
+  for (i = 0; i < MAX_DMABUF_PLANES; i++)
+    if (buffer->fd[i] != -1)
+      close (buffer->fd[i]);
+
+  if (buffer->image != EGL_NO_IMAGE_KHR)
+    destroy_image (buffer->display->egl_display, buffer->image);
+
+  g_free (buffer);
+}
+
+/* ===== BUFFER INTERFACE ====== */
+
+static void
+buffer_destroy (struct wl_client *client, struct wl_resource *resource)
+{
+  wl_resource_destroy (resource);
+}
+
+static const struct wl_buffer_interface dmabuf_buffer_interface = {
+  buffer_destroy
+};
+
+static void
+destroy_dmabuf_buffer (struct wl_resource *resource)
+{
+  nested_dmabuf_buffer_free (wl_resource_get_user_data (resource));
+}
+
+struct NestedDmabufBuffer *
+linux_dmabuf_buffer_get (struct wl_resource *resource)
+{
+  if (!wl_resource_instance_of (resource, &wl_buffer_interface,
+                                &dmabuf_buffer_interface))
+    return NULL;
+
+  return wl_resource_get_user_data (resource);
+}
+
+gboolean
+linux_dmabuf_buffer_is_opaque (struct NestedDmabufBuffer *buffer)
+{
+  switch (buffer->format) {
+  case fourcc_code ('X', 'R', '2', '4'):
+  case fourcc_code ('X', 'B', '2', '4'):
+  case fourcc_code ('R', 'X', '2', '4'):
+  case fourcc_code ('B', 'X', '2', '4'):
+  case fourcc_code ('X', 'R', '3', '0'):
+  case fourcc_code ('X', 'B', '3', '0'):
+  case fourcc_code ('R', 'G', '1', '6'):
+  case fourcc_code ('N', 'V', '1', '2'):
+    return TRUE;
+  default:
+    return FALSE;
+  }
+}
+
+gboolean
+linux_dmabuf_buffer_is_y_inverted (struct NestedDmabufBuffer *buffer)
+{
+  return (buffer->flags & ZWP_LINUX_BUFFER_PARAMS_V1_FLAGS_Y_INVERT) != 0;
+}
+
+/* ===== BUFFER PARAMS INTERFACE ====== */
+
+static void
+params_destroy (struct wl_client *client, struct wl_resource *resource)
+{
+  wl_resource_destroy (resource);
+}
+
+static void
+params_add (struct wl_client *client,
+            struct wl_resource *resource,
+            int32_t fd,
+            uint32_t plane_idx,
+            uint32_t offset,
+            uint32_t stride,
+            uint32_t modifier_hi,
+            uint32_t modifier_lo)
+{
+  struct NestedDmabufBuffer *buffer = wl_resource_get_user_data (resource);
+
+  if (!buffer) {
+    wl_resource_post_error (resource,
+                            ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_ALREADY_USED,
+                            "params was already used to create a wl_buffer");
+    close (fd);
+    return;
+  }
+
+  if (plane_idx >= MAX_DMABUF_PLANES) {
+    wl_resource_post_error (resource,
+                            ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_PLANE_IDX,
+                            "plane index %u is too high", plane_idx);
+    close (fd);
+    return;
+  }
+
+  if (buffer->fd[plane_idx] != -1) {
+    wl_resource_post_error (resource,
+                            ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_PLANE_SET,
+                            "a dmabuf has already been added for plane %u",
+                            plane_idx);
+    close (fd);
+    return;
+  }
+
+  buffer->fd[plane_idx] = fd;
+  buffer->offset[plane_idx] = offset;
+  buffer->stride[plane_idx] = stride;
+  buffer->modifier[plane_idx] = ((uint64_t) modifier_hi << 32) | modifier_lo;
+  buffer->n_planes++;
+}
+
+/* Checks the parameters and imports the dmabufs, taking ownership of
+   the buffer on success. Returns the new wl_buffer or NULL if the
+   client has to be told it failed */
+static struct wl_resource *
+params_create_buffer (struct wl_client *client,
+                      struct wl_resource *params_resource,
+                      uint32_t buffer_id,
+                      int32_t width, int32_t height,
+                      uint32_t format, uint32_t flags)
+{
+  struct NestedDmabufBuffer *buffer = wl_resource_get_user_data (params_resource);
+  int i;
+
+  if (!buffer) {
+    wl_resource_post_error (params_resource,
+                            ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_ALREADY_USED,
+                            "params was already used to create a wl_buffer");
+    return NULL;
+  }
+
+  /* the buffer is handed to the wl_buffer, or freed */
+  wl_resource_set_user_data (params_resource, NULL);
+
+  if (buffer->n_planes == 0) {
+    wl_resource_post_error (params_resource,
+                            ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_INCOMPLETE,
+                            "no dmabuf has been added to the params");
+    goto err;
+  }
+
+  for (i = 0; i < buffer->n_planes; i++) {
+    if (buffer->fd[i] == -1) {
+      wl_resource_post_error (params_resource,
+                              ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_INCOMPLETE,
+                              "no dmabuf has been added for plane %i", i);
+      goto err;
+    }
+
+    if (buffer->modifier[i] != buffer->modifier[0]) {
+      wl_resource_post_error (params_resource,
+                              ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_INVALID_FORMAT,
+                              "planes have different modifiers");
+      goto err;
+    }
+  }
+
+  if (width < 1 || height < 1) {
+    wl_resource_post_error (params_resource,
+                            ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_INVALID_DIMENSIONS,
+                            "invalid width %d or height %d", width, height);
+    goto err;
+  }
+
+  buffer->width = width;
+  buffer->height = height;
+  buffer->format = format;
+  buffer->flags = flags;
+
+  /* y-inverted buffers are flipped when drawn, interlaced ones are not
+     supported */
+  if (flags & ~ZWP_LINUX_BUFFER_PARAMS_V1_FLAGS_Y_INVERT) {
+    log_warning (LOG_DMABUF, "unsupported dmabuf flags 0x%x", flags);
+    goto failed;
+  }
+
+  /* the EGLImage is what the compositor caches for the wl_buffer */
+  buffer->image = import_dmabuf (buffer);
+  if (buffer->image == EGL_NO_IMAGE_KHR) {
+    log_warning (LOG_DMABUF, "failed to import dmabuf buffer");
+    goto failed;
+  }
+
+  buffer->resource = wl_resource_create (client, &wl_buffer_interface,
+                                         1, buffer_id);
+  if (!buffer->resource) {
+    wl_resource_post_no_memory (params_resource);
+    goto err;
+  }
+
+  wl_resource_set_implementation (buffer->resource, &dmabuf_buffer_interface,
+                                  buffer, destroy_dmabuf_buffer);
+
+  return buffer->resource;
+
+ failed:
+  if (buffer_id == 0)
+    zwp_linux_buffer_params_v1_send_failed (params_resource);
+  else
+    wl_resource_post_error (params_resource,
+                            ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_INVALID_WL_BUFFER,
+                            "importing the supplied dmabufs failed");
+ err:
+  nested_dmabuf_buffer_free (buffer);
+  return NULL;
+}
+
+static void
+params_create (struct wl_client *client,
+               struct wl_resource *resource,
+               int32_t width, int32_t height,
+               uint32_t format, uint32_t flags)
+{
+  struct wl_resource *buffer_resource;
+
+  buffer_resource = params_create_buffer (client, resource, 0,
+                                          width, height, format, flags);
+  if (buffer_resource)
+    zwp_linux_buffer_params_v1_send_created (resource, buffer_resource);
+}
+
+static void
+params_create_immed (struct wl_client *client,
+                     struct wl_resource *resource,
+                     uint32_t buffer_id,
+                     int32_t width, int32_t height,
+                     uint32_t format, uint32_t flags)
+{
+  params_create_buffer (client, resource, buffer_id,
+                        width, height, format, flags);
+}
+
+static const struct zwp_linux_buffer_params_v1_interface params_interface = {
+  params_destroy,
+  params_add,
+  params_create,
+  params_create_immed
+};
+
+static void
+destroy_params (struct wl_resource *resource)
+{
+  struct NestedDmabufBuffer *buffer = wl_resource_get_user_data (resource);
+
+  /* not used to create a buffer */
+  if (buffer)
+    nested_dmabuf_buffer_free (buffer);
+}
+
+/* ===== LINUX DMABUF INTERFACE ====== */
+
+static void
+linux_dmabuf_destroy (struct wl_client *client, struct wl_resource *resource)
+{
+  wl_resource_destroy (resource);
+}
+
+static void
+linux_dmabuf_create_params (struct wl_client *client,
+                            struct wl_resource *resource,
+                            uint32_t params_id)
+{
+  struct Compositor *c = wl_resource_get_user_data (resource);
+  struct NestedDmabufBuffer *buffer;
+  struct wl_resource *params_resource;
+  int i;
+
+  buffer = g_new0 (struct NestedDmabufBuffer, 1);
+  buffer->display = c->display;
+  buffer->image = EGL_NO_IMAGE_KHR;
+  for (i = 0; i < MAX_DMABUF_PLANES; i++)
+    buffer->fd[i] = -1;
+
+  params_resource =
+    wl_resource_create (client, &zwp_linux_buffer_params_v1_interface,
+                        wl_resource_get_version (resource), params_id);
+  if (!params_resource) {
+    g_free (buffer);
+    wl_resource_post_no_memory (resource);
+    return;
+  }
+
+  wl_resource_set_implementation (params_resource, &params_interface,
+                                  buffer, destroy_params);
+}
+
+static const struct zwp_linux_dmabuf_v1_interface linux_dmabuf_interface = {
+  linux_dmabuf_destroy,
+  linux_dmabuf_create_params
+};
+
+/* Advertises what EGL can import, with the modifiers of each format
+   when both the client and EGL know about them */
+static void
+send_formats (struct Compositor *c, struct wl_resource *resource)
+{
+  EGLDisplay egl_display = c->display->egl_display;
+  EGLint *formats = NULL;
+  EGLuint64KHR *modifiers = NULL;
+  EGLint n_formats = 0, n_modifiers;
+  int i, j;
+
+  if (query_dmabuf_formats &&
+      query_dmabuf_formats (egl_display, 0, NULL, &n_formats) &&
+      n_formats > 0) {
+    formats = g_new (EGLint, n_formats);
+    if (!query_dmabuf_formats (egl_display, n_formats, formats, &n_formats))
+      n_formats = 0;
+  }
+
+  /* a driver that can't list them still handles the common ones */
+  if (n_formats == 0) {
+    g_free (formats);
+    n_formats = 2;
+    formats = g_new (EGLint, n_formats);
+    formats[0] = fourcc_code ('A', 'R', '2', '4');
+    formats[1] = fourcc_code ('X', 'R', '2', '4');
+  }
+
+  for (i = 0; i < n_formats; i++) {
+    if (wl_resource_get_version (resource) <
+        ZWP_LINUX_DMABUF_V1_MODIFIER_SINCE_VERSION) {
+      zwp_linux_dmabuf_v1_send_format (resource, formats[i]);
+      continue;
+    }
+
+    n_modifiers = 0;
+    if (has_modifiers)
+      query_dmabuf_modifiers (egl_display, formats[i], 0, NULL, NULL,
+                              &n_modifiers);
+
+    if (n_modifiers == 0) {
+      zwp_linux_dmabuf_v1_send_modifier (resource, formats[i],
+                                         DRM_FORMAT_MOD_INVALID >> 32,
+                                         DRM_FORMAT_MOD_INVALID & 0xffffffff);
+      continue;
+    }
+
+    modifiers = g_renew (EGLuint64KHR, modifiers, n_modifiers);
+    query_dmabuf_modifiers (egl_display, formats[i], n_modifiers,
+                            modifiers, NULL, &n_modifiers);
+    for (j = 0; j < n_modifiers; j++)
+      zwp_linux_dmabuf_v1_send_modifier (resource, formats[i],
+                                         modifiers[j] >> 32,
+                                         modifiers[j] & 0xffffffff);
+  }
+
+  g_free (modifiers);
+  g_free (formats);
+}
+
+static void
+linux_dmabuf_bind (struct wl_client *client, void *data, uint32_t version, uint32_t id)
+{
+  struct Compositor *c = data;
+  struct wl_resource *resource =
+    wl_resource_create (client, &zwp_linux_dmabuf_v1_interface,
+                        MIN (version, 3), id);
+  wl_resource_set_implementation (resource, &linux_dmabuf_interface, c, NULL);
+
+  send_formats (c, resource);
+}
+
+int
+linux_dmabuf_init (struct Compositor *c)
+{
+  const gchar *extensions;
+
+  extensions = eglQueryString (c->display->egl_display, EGL_EXTENSIONS);
+  if (strstr (extensions, "EGL_EXT_image_dma_buf_import") == NULL) {
+    log_info (LOG_DMABUF, "no EGL_EXT_image_dma_buf_import extension");
+    return -1;
+  }
+
+  create_image = (void *) eglGetProcAddress ("eglCreateImageKHR");
+  destroy_image = (void *) eglGetProcAddress ("eglDestroyImageKHR");
+
+  if (strstr (extensions, "EGL_EXT_image_dma_buf_import_modifiers")) {
+    has_modifiers = TRUE;
+    query_dmabuf_formats = (void *) eglGetProcAddress ("eglQueryDmaBufFormatsEXT");
+    query_dmabuf_modifiers = (void *) eglGetProcAddress ("eglQueryDmaBufModifiersEXT");
+  }
+
+  if (!wl_global_create (c->child_display,
+                         &zwp_linux_dmabuf_v1_interface, 3,
+                         c, linux_dmabuf_bind)) {
+    log_error (LOG_DMABUF, "failed to create zwp_linux_dmabuf_v1 global");
+    return -1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,35 @@
+#ifndef __LINUX_DMABUF_H__
+#define __LINUX_DMABUF_H__
+
+#include "compositor.h"
+
+#define MAX_DMABUF_PLANES 4
+
+/* wl_buffer created by clients through zwp_linux_dmabuf_v1. The dmabufs
+   are imported as an EGLImage when the buffer is created, which also
+   validates them */
+struct NestedDmabufBuffer {
+  struct wl_resource *resource;
+  struct Display *display;
+
+  int32_t width, height;
+  uint32_t format;
+  uint32_t flags;
+  int n_planes;
+  int fd[MAX_DMABUF_PLANES];
+  uint32_t offset[MAX_DMABUF_PLANES];
+  uint32_t stride[MAX_DMABUF_PLANES];
+  uint64_t modifier[MAX_DMABUF_PLANES];
+
+  EGLImageKHR image;
+};
+
+int                        linux_dmabuf_init       (struct Compositor *compositor);
+
+struct NestedDmabufBuffer *linux_dmabuf_buffer_get (struct wl_resource *resource);
+
+gboolean                   linux_dmabuf_buffer_is_opaque (struct NestedDmabufBuffer *buffer);
+
+gboolean                   linux_dmabuf_buffer_is_y_inverted (struct NestedDmabufBuffer *buffer);
+
+#endif
@@ -0,0 +1,178 @@
+#include "log.h"
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+struct LogEntry {
+  struct LogEntry *next;
+  char text[];
+};
+
+int log_level = LOG_LEVEL_INFO;
+guint log_categories = (1 << LOG_N_CATEGORIES) - 1;
+
+static const char *level_names[] = {
+  "error",
+  "warning",
+  "info",
+  "debug"
+};
+
+static const char *category_names[LOG_N_CATEGORIES] = {
+  "server",
+  "compositor",
+  "dispatch",
+  "gl-renderer",
+  "passthrough",
+  "linux-dmabuf",
+  "timing",
+  "launcher"
+};
+
+/* Messages waiting for the writer thread, newest first. Producers push
+   with a compare-and-swap and the writer takes the whole list at once,
+   so neither side ever blocks the other */
+static struct LogEntry *pending;
+static int wake_fd = -1;
+static GThread *writer;
+
+/* held by whoever writes to stderr, from taking the batch to the last
+   line of it, so that errors written right away come after the messages
+   queued before them */
+static GMutex write_lock;
+
+static struct LogEntry *
+take_pending (void)
+{
+  struct LogEntry *list;
+
+  do
+    list = g_atomic_pointer_get (&pending);
+  while (!g_atomic_pointer_compare_and_exchange (&pending, list, NULL));
+
+  return list;
+}
+
+static void
+write_entries (struct LogEntry *list)
+{
+  struct LogEntry *entry, *next, *ordered = NULL;
+
+  if (!list)
+    return;
+
+  /* back to the order they were logged in */
+  for (entry = list; entry; entry = next) {
+    next = entry->next;
+    entry->next = ordered;
+    ordered = entry;
+  }
+
+  for (entry = ordered; entry; entry = next) {
+    next = entry->next;
+    fputs (entry->text, stderr);
+    g_free (entry);
+  }
+
+  fflush (stderr);
+}
+
+static void
+log_flush (void)
+{
+  g_mutex_lock (&write_lock);
+  write_entries (take_pending ());
+  g_mutex_unlock (&write_lock);
+}
+
+static gpointer
+log_writer_run (gpointer data)
+{
+  uint64_t count;
+
+  for (;;) {
+    if (read (wake_fd, &count, sizeof count) < 0)
+      g_usleep (10000);
+    log_flush ();
+  }
+
+  return NULL;
+}
+
+void
+log_write (enum LogLevel level, enum LogCategory category,
+           const char *format, ...)
+{
+  struct LogEntry *entry, *head;
+  va_list args;
+  char *message;
+  uint64_t one = 1;
+  size_t size;
+
+  va_start (args, format);
+  message = g_strdup_vprintf (format, args);
+  va_end (args);
+
+  size = strlen (category_names[category]) + strlen (message) + 4;
+  entry = g_malloc (sizeof (struct LogEntry) + size);
+  snprintf (entry->text, size, "%s: %s\n", category_names[category], message);
+  g_free (message);
+
+  /* errors are written right away, the process may be about to die */
+  if (!writer || level == LOG_LEVEL_ERROR) {
+    g_mutex_lock (&write_lock);
+    write_entries (take_pending ());
+    entry->next = NULL;
+    write_entries (entry);
+    g_mutex_unlock (&write_lock);
+    return;
+  }
+
+  do {
+    head = g_atomic_pointer_get (&pending);
+    entry->next = head;
+  } while (!g_atomic_pointer_compare_and_exchange (&pending, head, entry));
+
+  /* the writer only needs waking up for the first message of a batch */
+  if (!head && write (wake_fd, &one, sizeof one) < 0)
+    log_flush ();
+}
+
+/* NESTED_LOG_LEVEL is one of error, warning, info or debug, and
+   NESTED_LOG a comma separated list of the categories to show */
+void
+log_init (void)
+{
+  const char *level = g_getenv ("NESTED_LOG_LEVEL");
+  const char *categories = g_getenv ("NESTED_LOG");
+  char **names;
+  int i, j;
+
+  if (level) {
+    for (i = 0; i < G_N_ELEMENTS (level_names); i++)
+      if (g_strcmp0 (level, level_names[i]) == 0)
+        log_level = i;
+  }
+
+  if (categories) {
+    log_categories = 0;
+    names = g_strsplit (categories, ",", -1);
+    for (i = 0; names[i]; i++)
+      for (j = 0; j < LOG_N_CATEGORIES; j++)
+        if (g_strcmp0 (names[i], category_names[j]) == 0)
+          log_categories |= 1 << j;
+    g_strfreev (names);
+  }
+
+  wake_fd = eventfd (0, EFD_CLOEXEC);
+  if (wake_fd < 0)
+    return;
+
+  writer = g_thread_new ("log-writer", log_writer_run, NULL);
+  atexit (log_flush);
+}
@@ -0,0 +1,76 @@
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#include <glib.h>
+
+enum LogLevel {
+  LOG_LEVEL_ERROR,
+  LOG_LEVEL_WARNING,
+  LOG_LEVEL_INFO,
+  LOG_LEVEL_DEBUG
+};
+
+/* Categories double as the prefix of their messages */
+enum LogCategory {
+  LOG_SERVER,
+  LOG_COMPOSITOR,
+  LOG_DISPATCH,
+  LOG_GL_RENDERER,
+  LOG_PASSTHROUGH,
+  LOG_DMABUF,
+  LOG_TIMING,
+  LOG_LAUNCHER,
+  LOG_N_CATEGORIES
+};
+
+/* Messages above this level are not compiled in. Release builds keep
+   warnings and errors only, so the per-frame debug messages cost
+   nothing there */
+#ifndef LOG_MAX_LEVEL
+#ifdef NDEBUG
+#define LOG_MAX_LEVEL LOG_LEVEL_WARNING
+#else
+#define LOG_MAX_LEVEL LOG_LEVEL_DEBUG
+#endif
+#endif
+
+/* Runtime filter, from NESTED_LOG_LEVEL and NESTED_LOG */
+extern int log_level;
+extern guint log_categories;
+
+void log_init  (void);
+
+void log_write (enum LogLevel level, enum LogCategory category,
+                const char *format, ...) G_GNUC_PRINTF (3, 4);
+
+#define log_message(level, category, ...)                               \
+  G_STMT_START {                                                        \
+    if ((level) <= log_level && (log_categories & (1 << (category))))   \
+      log_write ((level), (category), __VA_ARGS__);                     \
+  } G_STMT_END
+
+#define log_error(category, ...) \
+  log_message (LOG_LEVEL_ERROR, category, __VA_ARGS__)
+
+#if LOG_MAX_LEVEL >= LOG_LEVEL_WARNING
+#define log_warning(category, ...) \
+  log_message (LOG_LEVEL_WARNING, category, __VA_ARGS__)
+#else
+#define log_warning(category, ...) G_STMT_START { } G_STMT_END
+#endif
+
+#if LOG_MAX_LEVEL >= LOG_LEVEL_INFO
+#define log_info(category, ...) \
+  log_message (LOG_LEVEL_INFO, category, __VA_ARGS__)
+#else
+#define log_info(category, ...) G_STMT_START { } G_STMT_END
+#endif
+
+#if LOG_MAX_LEVEL >= LOG_LEVEL_DEBUG
+#define log_debug(category, ...) \
+  log_message (LOG_LEVEL_DEBUG, category, __VA_ARGS__)
+#else
+#define log_debug(category, ...) G_STMT_START { } G_STMT_END
+#endif
+
+#endif
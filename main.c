@@ -3,17 +3,69 @@
 #include <wayland-server.h>
 #include <assert.h>
 #include <string.h>
-#include <sys/socket.h>
 #include <stdlib.h>
 
+#include "bench.h"
 #include "compositor.h"
+#include "gl-renderer.h"
+#include "launcher.h"
+#include "log.h"
+#include "timing.h"
+#include "linux-dmabuf-unstable-v1-client-protocol.h"
 #include "os-compatibility.h"
 
 /* ------------- Misc -------------- */
 
+/* Realizes a GDK GL context for the toplevel and returns the EGL context
+   behind it, for ours to join its share group. GDK paints with EGL on
+   Wayland, which is the only case the contexts can share, and it has to
+   be a GLES context like ours: EGL doesn't share across client APIs */
+static EGLContext
+init_gdk_gl (struct Display *d, GdkWindow *window)
+{
+  GError *error = NULL;
+  GdkGLContext *gl_context;
+  EGLContext ctx;
+
+  gl_context = gdk_window_create_gl_context (window, &error);
+  if (gl_context) {
+    gdk_gl_context_set_use_es (gl_context, TRUE);
+    if (!gdk_gl_context_realize (gl_context, &error))
+      g_clear_object (&gl_context);
+  }
+  if (!gl_context) {
+    log_info (LOG_SERVER, "no GDK GL context, compositing through cairo: %s",
+              error->message);
+    g_error_free (error);
+    return EGL_NO_CONTEXT;
+  }
+
+  /* the request is only a preference, GDK may still pick desktop GL */
+  if (!gdk_gl_context_get_use_es (gl_context)) {
+    log_info (LOG_SERVER, "GDK paints with desktop GL, which can't share with our GLES context, compositing through cairo");
+    g_object_unref (gl_context);
+    return EGL_NO_CONTEXT;
+  }
+
+  /* GDK binds the client API of its context when making it current */
+  gdk_gl_context_make_current (gl_context);
+  ctx = eglGetCurrentContext ();
+  gdk_gl_context_clear_current ();
+
+  if (ctx == EGL_NO_CONTEXT) {
+    log_info (LOG_SERVER, "GDK doesn't paint with EGL, compositing through cairo");
+    g_object_unref (gl_context);
+    return EGL_NO_CONTEXT;
+  }
+
+  d->gl_context = gl_context;
+  return ctx;
+}
+
 static void
-init_egl (struct Display *d)
+init_egl (struct Display *d, GdkWindow *window)
 {
+  EGLContext share = EGL_NO_CONTEXT;
   EGLint major, minor;
   EGLint n;
   int ret;
@@ -39,13 +91,26 @@ init_egl (struct Display *d)
   ret = eglInitialize(d->egl_display, &major, &minor);
   assert(ret == EGL_TRUE);
 
+  if (g_strcmp0 (g_getenv ("NESTED_GDK_GL"), "0") != 0)
+    share = init_gdk_gl (d, window);
+
   eglBindAPI(EGL_OPENGL_ES_API);
   assert(ret == EGL_TRUE);
 
   ret = eglChooseConfig(d->egl_display, egl_cfg_attribs, &d->egl_config, 1, &n);
   assert(ret && n == 1);
 
-  d->egl_ctx = eglCreateContext(d->egl_display, d->egl_config, EGL_NO_CONTEXT, context_attribs);
+  /* in the share group of GDK, the textures we import can be composited
+     by GDK straight into the window */
+  if (share != EGL_NO_CONTEXT) {
+    d->egl_ctx = eglCreateContext(d->egl_display, d->egl_config, share, context_attribs);
+    if (d->egl_ctx == EGL_NO_CONTEXT) {
+      log_info (LOG_SERVER, "can't share textures with GDK, compositing through cairo");
+      g_clear_object (&d->gl_context);
+    }
+  }
+  if (d->egl_ctx == EGL_NO_CONTEXT)
+    d->egl_ctx = eglCreateContext(d->egl_display, d->egl_config, EGL_NO_CONTEXT, context_attribs);
   assert(d->egl_ctx);
 
   ret = eglMakeCurrent(d->egl_display, NULL, NULL, d->egl_ctx);
@@ -55,8 +120,61 @@ init_egl (struct Display *d)
   assert (cairo_device_status(d->egl_device) == CAIRO_STATUS_SUCCESS);
 }
 
+static void
+registry_handle_global (void *data, struct wl_registry *registry,
+                        uint32_t name, const char *interface, uint32_t version)
+{
+  struct Display *d = data;
+
+  if (strcmp (interface, "wl_compositor") == 0)
+    d->compositor = wl_registry_bind (registry, name,
+                                      &wl_compositor_interface,
+                                      MIN (version, 3));
+  else if (strcmp (interface, "wl_subcompositor") == 0)
+    d->subcompositor = wl_registry_bind (registry, name,
+                                         &wl_subcompositor_interface, 1);
+  else if (strcmp (interface, "zwp_linux_dmabuf_v1") == 0 && version >= 2)
+    d->dmabuf = wl_registry_bind (registry, name,
+                                  &zwp_linux_dmabuf_v1_interface, 2);
+}
+
+static void
+registry_handle_global_remove (void *data, struct wl_registry *registry,
+                               uint32_t name)
+{
+}
+
+static const struct wl_registry_listener registry_listener = {
+  registry_handle_global,
+  registry_handle_global_remove
+};
+
+/* Binds the parent compositor globals we need on our own queue, so that
+   the roundtrip doesn't dispatch GDK events */
+static void
+init_globals (struct Display *d)
+{
+  struct wl_event_queue *queue = wl_display_create_queue (d->wl_display);
+  struct wl_registry *registry = wl_display_get_registry (d->wl_display);
+
+  wl_proxy_set_queue ((struct wl_proxy *) registry, queue);
+  wl_registry_add_listener (registry, &registry_listener, d);
+  wl_display_roundtrip_queue (d->wl_display, queue);
+
+  /* bound globals go back to the default queue */
+  if (d->compositor)
+    wl_proxy_set_queue ((struct wl_proxy *) d->compositor, NULL);
+  if (d->subcompositor)
+    wl_proxy_set_queue ((struct wl_proxy *) d->subcompositor, NULL);
+  if (d->dmabuf)
+    wl_proxy_set_queue ((struct wl_proxy *) d->dmabuf, NULL);
+
+  wl_registry_destroy (registry);
+  wl_event_queue_destroy (queue);
+}
+
 static struct Display *
-display_create (void)
+display_create (GdkWindow *window)
 {
   GdkDisplay *gdk_display =
     gdk_display_manager_get_default_display (gdk_display_manager_get ());
@@ -66,13 +184,13 @@ display_create (void)
   d->wl_display =  gdk_wayland_display_get_wl_display (gdk_display);
 
   if (!d->wl_display) {
-    fprintf (stderr, "failed to connect to Wayland display\n");
+    log_error (LOG_SERVER, "failed to connect to Wayland display");
     g_free (d);
     return NULL;
   }
 
-  init_egl (d);
-
+  init_egl (d, window);
+  init_globals (d);
 
   return d;
 }
@@ -93,6 +211,10 @@ typedef struct _ViewWidgetPrivate ViewWidgetPrivate;
 struct  _ViewWidgetPrivate {
   struct Display *display;
   struct Compositor *compositor;
+
+  /* set when presenting through the GL renderer instead of cairo */
+  gboolean use_gl_renderer;
+  struct GLRenderer *gl_renderer;
 };
 
 struct _ViewWidget {
@@ -127,36 +249,146 @@ draw_dummy (GtkWidget *widget, cairo_t *cr)
 #endif
 
 static void
-draw (GtkWidget *widget, cairo_t *cr)
+draw_surface (GtkWidget *widget, cairo_t *cr,
+              struct NestedSurface *nested_surface)
 {
-  cairo_surface_t *surface;
-  ViewWidget *vw = VIEW_WIDGET (widget);
-  GtkAllocation allocation;
+  cairo_surface_t *surface = nested_surface->cairo_surface;
+  struct wl_shm_buffer *shm_buffer = NULL;
+  cairo_rectangle_list_t *clip;
+  pixman_region32_t region, opaque;
+  pixman_box32_t *rects;
+  cairo_matrix_t matrix;
+  double x, y, scale_x, scale_y;
+  int i, n_rects;
+
+  if (!surface)
+    return;
 
-  if (!vw->priv->compositor || !vw->priv->compositor->nested_surface)
+  compositor_get_surface_geometry (nested_surface->compositor, nested_surface,
+                                   &x, &y, &scale_x, &scale_y);
+
+  /* GDK composites textures of its share group into the window when it
+     paints with GL, only the unscaled ones though */
+  if (nested_surface->gdk_texture && !nested_surface->gdk_texture_dirty &&
+      scale_x == 1.0 && scale_y == 1.0) {
+    cairo_save (cr);
+    cairo_translate (cr, x, y);
+    gdk_cairo_draw_from_gl (cr, gtk_widget_get_window (widget),
+                            nested_surface->gdk_texture, GL_TEXTURE,
+                            nested_surface->gdk_texture_scale, 0, 0,
+                            nested_surface->gdk_texture_width,
+                            nested_surface->gdk_texture_height);
+    cairo_restore (cr);
     return;
+  }
+
+  /* the surface may be wrapping the shm pool memory of the client */
+  if (nested_surface->buffer && nested_surface->buffer->shm_buffer &&
+      surface == nested_surface->buffer->cairo_surface)
+    shm_buffer = nested_surface->buffer->shm_buffer;
+
+  if (shm_buffer)
+    wl_shm_buffer_begin_access (shm_buffer);
+
+  cairo_save (cr);
+  cairo_translate (cr, x, y);
+  cairo_scale (cr, scale_x, scale_y);
 
-  surface = vw->priv->compositor->nested_surface->cairo_surface;
   cairo_set_operator (cr, CAIRO_OPERATOR_OVER);
-  gtk_widget_get_allocation (widget, &allocation);
   cairo_surface_mark_dirty (surface);
   cairo_set_source_surface (cr, surface, 0, 0);
-  cairo_rectangle (cr, 0, 0, allocation.width, allocation.height);
-  cairo_fill (cr);
+
+  /* scaled, transformed or cropped buffers are mapped to the surface
+     while sampling them */
+  if (nested_surface_get_buffer_matrix (nested_surface, &matrix))
+    cairo_pattern_set_matrix (cairo_get_source (cr), &matrix);
+
+  /* GTK clips the context to the region invalidated from the nested
+     surface damage, only fill those rectangles */
+  cairo_rectangle (cr, 0, 0, nested_surface->width, nested_surface->height);
+  cairo_clip (cr);
+
+  pixman_region32_init (&region);
+  clip = cairo_copy_clip_rectangle_list (cr);
+  if (clip->status == CAIRO_STATUS_SUCCESS) {
+    for (i = 0; i < clip->num_rectangles; i++)
+      pixman_region32_union_rect (&region, &region,
+                                  clip->rectangles[i].x, clip->rectangles[i].y,
+                                  clip->rectangles[i].width,
+                                  clip->rectangles[i].height);
+  } else {
+    pixman_region32_union_rect (&region, &region, 0, 0,
+                                nested_surface->width, nested_surface->height);
+  }
+  cairo_rectangle_list_destroy (clip);
+
+  /* the opaque part is copied over what is below, only the rest needs
+     blending */
+  nested_surface_get_opaque_region (nested_surface, &opaque);
+  pixman_region32_intersect (&opaque, &opaque, &region);
+  pixman_region32_subtract (&region, &region, &opaque);
+
+  if (pixman_region32_not_empty (&opaque)) {
+    rects = pixman_region32_rectangles (&opaque, &n_rects);
+    for (i = 0; i < n_rects; i++)
+      cairo_rectangle (cr, rects[i].x1, rects[i].y1,
+                       rects[i].x2 - rects[i].x1, rects[i].y2 - rects[i].y1);
+    cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
+    cairo_fill (cr);
+    cairo_set_operator (cr, CAIRO_OPERATOR_OVER);
+  }
+
+  if (pixman_region32_not_empty (&region)) {
+    rects = pixman_region32_rectangles (&region, &n_rects);
+    for (i = 0; i < n_rects; i++)
+      cairo_rectangle (cr, rects[i].x1, rects[i].y1,
+                       rects[i].x2 - rects[i].x1, rects[i].y2 - rects[i].y1);
+    cairo_fill (cr);
+  }
+
+  pixman_region32_fini (&opaque);
+  pixman_region32_fini (&region);
+  cairo_restore (cr);
+
+  if (shm_buffer)
+    wl_shm_buffer_end_access (shm_buffer);
+}
+
+static void
+draw (GtkWidget *widget, cairo_t *cr)
+{
+  struct NestedSurface *nested_surface;
+  ViewWidget *vw = VIEW_WIDGET (widget);
+
+  if (!vw->priv->compositor)
+    return;
+
+  gl_renderer_update_gdk_textures (vw->priv->display, vw->priv->compositor);
+
+  wl_list_for_each (nested_surface, &vw->priv->compositor->surface_list, link)
+    draw_surface (widget, cr, nested_surface);
 }
 
 static gboolean
 view_widget_draw (GtkWidget* widget, cairo_t* cr)
 {
   ViewWidget *vw = VIEW_WIDGET (widget);
+  gint64 start = timing_begin ();
 
-  draw (widget, cr);
+  /* frame callbacks of the clients are fired by the compositor from
+     the after-paint phase of the frame clock. The surfaces and their
+     buffers can't change while we draw them */
+  compositor_lock (vw->priv->compositor);
+  compositor_import_surfaces (vw->priv->compositor);
+  if (vw->priv->gl_renderer)
+    gl_renderer_render (vw->priv->gl_renderer, vw->priv->compositor);
+  else
+    draw (widget, cr);
+  compositor_unlock (vw->priv->compositor);
 
-  /* let the compositor know we have rendered current frame
-     so it can throttle next frame from client */
-  compositor_frame_done (vw->priv->compositor);
+  timing_end (TIMING_DRAW, start);
 
-  g_print ("compositor: widget drawn\n");
+  log_debug (LOG_COMPOSITOR, "widget drawn");
 
   return FALSE;
 }
@@ -188,95 +420,170 @@ view_widget_realize(GtkWidget* widget)
 }
 
 static void
-view_widget_class_init (ViewWidgetClass* klass)
+view_widget_update_gl_renderer (GtkWidget *widget)
 {
-  GtkWidgetClass* widgetClass = GTK_WIDGET_CLASS (klass);
-  widgetClass->realize = view_widget_realize;
-  widgetClass->draw = view_widget_draw;
+  ViewWidget *vw = VIEW_WIDGET (widget);
+  int x, y;
 
-  g_type_class_add_private (klass, sizeof (ViewWidgetPrivate));
+  if (!vw->priv->gl_renderer)
+    return;
+
+  compositor_get_widget_offset (widget, &x, &y);
+  gl_renderer_set_geometry (vw->priv->gl_renderer, x, y,
+                            gtk_widget_get_allocated_width (widget),
+                            gtk_widget_get_allocated_height (widget));
 }
 
-static GtkWidget *
-view_widget_new (void)
+static void
+view_widget_size_allocate (GtkWidget *widget, GtkAllocation *allocation)
 {
-  ViewWidget* vw = VIEW_WIDGET (g_object_new (TYPE_VIEW_WIDGET, NULL));
-  vw->priv->display = display_create ();
-  vw->priv->compositor = compositor_create (GTK_WIDGET (vw), vw->priv->display);
-  return GTK_WIDGET(vw);
+  GTK_WIDGET_CLASS (view_widget_parent_class)->size_allocate (widget, allocation);
+  view_widget_update_gl_renderer (widget);
 }
 
-/* ------------- Program ---------------- */
-
 static void
-launch_client (ViewWidget *vw, const char *path)
+view_widget_map (GtkWidget *widget)
 {
-  int sv[2];
-  pid_t pid;
+  ViewWidget *vw = VIEW_WIDGET (widget);
 
-  printf ("server: launching client\n");
+  GTK_WIDGET_CLASS (view_widget_parent_class)->map (widget);
 
-  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
-    fprintf(stderr, "launch_client: "
-            "socketpair failed while launching '%s': %m\n", path);
-    exit(-1);
+  if (vw->priv->use_gl_renderer) {
+    vw->priv->gl_renderer =
+      gl_renderer_create (vw->priv->display, gtk_widget_get_window (widget));
+    if (!vw->priv->gl_renderer) {
+      log_info (LOG_SERVER, "GL renderer unavailable, drawing with cairo");
+      vw->priv->use_gl_renderer = FALSE;
+    }
+    view_widget_update_gl_renderer (widget);
   }
+}
 
-  pid = fork();
-  if (pid == -1) {
-    close(sv[0]);
-    close(sv[1]);
-    fprintf(stderr, "launch_client: "
-            "fork failed while launching '%s': %m\n", path);
-    exit(-1);
-  }
+static void
+view_widget_unmap (GtkWidget *widget)
+{
+  ViewWidget *vw = VIEW_WIDGET (widget);
 
-  if (pid == 0) {
-    int clientfd;
-    char s[32];
+  if (vw->priv->gl_renderer) {
+    gl_renderer_destroy (vw->priv->gl_renderer);
+    vw->priv->gl_renderer = NULL;
+  }
 
-    clientfd = dup(sv[1]);
-    if (clientfd == -1) {
-      fprintf(stderr, "compositor: dup failed: %m\n");
-      exit(-1);
-    }
+  GTK_WIDGET_CLASS (view_widget_parent_class)->unmap (widget);
+}
 
-    snprintf(s, sizeof s, "%d", clientfd);
-    setenv("WAYLAND_SOCKET", s, 1);
+static void
+view_widget_class_init (ViewWidgetClass* klass)
+{
+  GtkWidgetClass* widgetClass = GTK_WIDGET_CLASS (klass);
+  widgetClass->realize = view_widget_realize;
+  widgetClass->draw = view_widget_draw;
+  widgetClass->size_allocate = view_widget_size_allocate;
+  widgetClass->map = view_widget_map;
+  widgetClass->unmap = view_widget_unmap;
 
-    execl(path, path, NULL);
+  g_type_class_add_private (klass, sizeof (ViewWidgetPrivate));
+}
 
-    fprintf(stderr, "compositor: executing '%s' failed: %m\n", path);
-    exit(-1);
+static GtkWidget *
+view_widget_new (struct Display *display)
+{
+  ViewWidget* vw = VIEW_WIDGET (g_object_new (TYPE_VIEW_WIDGET, NULL));
+  vw->priv->display = display;
+  vw->priv->compositor = compositor_create (GTK_WIDGET (vw), vw->priv->display);
+  if (!vw->priv->compositor) {
+    g_object_ref_sink (vw);
+    g_object_unref (vw);
+    return NULL;
   }
+  vw->priv->use_gl_renderer =
+    g_strcmp0 (g_getenv ("NESTED_RENDERER"), "gl") == 0;
+  return GTK_WIDGET(vw);
+}
 
-  close(sv[1]);
-
-  if (!wl_client_create(vw->priv->compositor->child_display, sv[0])) {
-    close(sv[0]);
-    fprintf(stderr, "launch_client: "
-            "wl_client_create failed while launching '%s'.\n", path);
-    exit(-1);
-  }
+/* ------------- Program ---------------- */
 
-  printf ("server: launch client finished\n");
-}
+static gint n_views = 1;
+static gint n_clients = 1;
+static gint n_pooled = 0;
+static gint n_frames = 0;
+static gchar *client_args = NULL;
+
+static GOptionEntry entries[] = {
+  { "views", 'v', 0, G_OPTION_ARG_INT, &n_views,
+    "Number of views, side by side in the window", "N" },
+  { "clients", 'n', 0, G_OPTION_ARG_INT, &n_clients,
+    "Number of nested clients in each view", "N" },
+  { "pool", 'p', 0, G_OPTION_ARG_INT, &n_pooled,
+    "Keep N clients started and connected ahead of time, for showing "
+    "new clients faster", "N" },
+  { "frames", 'f', 0, G_OPTION_ARG_INT, &n_frames,
+    "Quit after painting N frames of client contents and report "
+    "frame rate, latency and CPU time", "N" },
+  { "client-args", 'a', 0, G_OPTION_ARG_STRING, &client_args,
+    "Arguments of the clients, for their load mode", "ARGS" },
+  { NULL }
+};
 
 int main(int argc, char *argv[])
 {
-  gtk_init (&argc, &argv);
+  GError *error = NULL;
+  struct Launcher *launcher;
+  struct Display *display;
+  GtkWidget *window, *box, *vw;
+  char **args = NULL;
+  int i, j;
+
+  if (!gtk_init_with_args (&argc, &argv, NULL, entries, NULL, &error)) {
+    log_error (LOG_SERVER, "%s", error->message);
+    g_error_free (error);
+    return -1;
+  }
+
+  if (client_args && *client_args &&
+      !g_shell_parse_argv (client_args, NULL, &args, &error)) {
+    log_error (LOG_SERVER, "--client-args: %s", error->message);
+    g_error_free (error);
+    return -1;
+  }
 
-  GtkWidget *window = gtk_window_new (GTK_WINDOW_TOPLEVEL);
+  log_init ();
+  timing_init ();
+  bench_init (n_frames);
+
+  window = gtk_window_new (GTK_WINDOW_TOPLEVEL);
   g_signal_connect (window, "destroy", G_CALLBACK (gtk_main_quit), NULL);
 
-  GtkWidget *vw = view_widget_new ();
-  gtk_container_add (GTK_CONTAINER (window), vw);
+  /* views share the EGL context along with the child display, which
+     shares its textures with the GDK context of the window */
+  gtk_widget_realize (window);
+  display = display_create (gtk_widget_get_window (window));
+  if (!display)
+    return -1;
+
+  box = gtk_box_new (GTK_ORIENTATION_HORIZONTAL, 0);
+  gtk_container_add (GTK_CONTAINER (window), box);
+  gtk_widget_show (box);
+
+  for (i = 0; i < MAX (n_views, 1); i++) {
+    vw = view_widget_new (display);
+    if (!vw)
+      return -1;
+    gtk_box_pack_start (GTK_BOX (box), vw, TRUE, TRUE, 0);
+    gtk_widget_show (vw);
+
+    /* every client connects to the same child display, and shows up
+       in the view it was launched for */
+    launcher = launcher_new (VIEW_WIDGET (vw)->priv->compositor, "client",
+                             args, n_pooled);
+    for (j = 0; j < n_clients; j++)
+      if (!launcher_launch (launcher))
+        log_warning (LOG_SERVER, "failed to launch client %d of view %d",
+                     j, i);
+  }
 
-  gtk_widget_show (vw);
   gtk_widget_show (window);
 
-  launch_client (VIEW_WIDGET (vw), "client");
-
   gtk_main ();
 
   return 0;
@@ -0,0 +1,234 @@
+#include "passthrough.h"
+#include "log.h"
+#include "linux-dmabuf-unstable-v1-client-protocol.h"
+
+#include <gdk/gdkwayland.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_PLANES 4
+
+/* EGL functions */
+static PFNEGLEXPORTDMABUFIMAGEQUERYMESAPROC export_query;
+static PFNEGLEXPORTDMABUFIMAGEMESAPROC export_image;
+
+struct Passthrough {
+  struct Compositor *compositor;
+  struct Display *display;
+  struct wl_surface *surface;
+  struct wl_subsurface *subsurface;
+  gboolean mapped;
+  int scale;
+};
+
+/* Outlives the passthrough, the parent compositor answers whenever it
+   gets to the request */
+struct PassthroughExport {
+  struct Compositor *compositor;
+  struct zwp_linux_buffer_params_v1 *params;
+  PassthroughExportFunc func;
+  void *data;
+};
+
+struct Passthrough *
+passthrough_create (struct Compositor *compositor, GdkWindow *window)
+{
+  struct Display *d = compositor->display;
+  struct Passthrough *p;
+  struct wl_surface *parent;
+  struct wl_region *region;
+  const gchar *extensions;
+
+  if (!d->compositor || !d->subcompositor || !d->dmabuf) {
+    log_info (LOG_PASSTHROUGH, "parent compositor lacks subsurfaces or dmabuf");
+    return NULL;
+  }
+
+  extensions = eglQueryString (d->egl_display, EGL_EXTENSIONS);
+  if (!strstr (extensions, "EGL_MESA_image_dma_buf_export")) {
+    log_info (LOG_PASSTHROUGH, "no EGL_MESA_image_dma_buf_export extension");
+    return NULL;
+  }
+
+  export_query = (void *) eglGetProcAddress ("eglExportDMABUFImageQueryMESA");
+  export_image = (void *) eglGetProcAddress ("eglExportDMABUFImageMESA");
+
+  parent =
+    gdk_wayland_window_get_wl_surface (gdk_window_get_effective_toplevel (window));
+  if (!parent)
+    return NULL;
+
+  p = g_new0 (struct Passthrough, 1);
+  p->compositor = compositor;
+  p->display = d;
+  p->scale = 1;
+  p->surface = wl_compositor_create_surface (d->compositor);
+  p->subsurface = wl_subcompositor_get_subsurface (d->subcompositor,
+                                                   p->surface, parent);
+
+  /* client frames go to the screen as they come, and input keeps going
+     to the GTK window underneath */
+  wl_subsurface_set_desync (p->subsurface);
+  region = wl_compositor_create_region (d->compositor);
+  wl_surface_set_input_region (p->surface, region);
+  wl_region_destroy (region);
+
+  return p;
+}
+
+void
+passthrough_destroy (struct Passthrough *p)
+{
+  wl_subsurface_destroy (p->subsurface);
+  wl_surface_destroy (p->surface);
+  g_free (p);
+}
+
+void
+passthrough_set_position (struct Passthrough *p, int x, int y)
+{
+  /* applied with the next commit of the toplevel */
+  wl_subsurface_set_position (p->subsurface, x, y);
+}
+
+static void
+export_free (struct PassthroughExport *export)
+{
+  zwp_linux_buffer_params_v1_destroy (export->params);
+  g_free (export);
+}
+
+static void
+export_created (void *data, struct zwp_linux_buffer_params_v1 *params,
+                struct wl_buffer *buffer)
+{
+  struct PassthroughExport *export = data;
+  struct Compositor *c = export->compositor;
+
+  compositor_lock (c);
+  if (export->func)
+    export->func (buffer, export->data);
+  else
+    wl_buffer_destroy (buffer);
+  compositor_unlock (c);
+
+  export_free (export);
+}
+
+static void
+export_failed (void *data, struct zwp_linux_buffer_params_v1 *params)
+{
+  struct PassthroughExport *export = data;
+  struct Compositor *c = export->compositor;
+
+  log_info (LOG_PASSTHROUGH, "parent compositor refused the dmabufs");
+
+  compositor_lock (c);
+  if (export->func)
+    export->func (NULL, export->data);
+  compositor_unlock (c);
+
+  export_free (export);
+}
+
+static const struct zwp_linux_buffer_params_v1_listener export_listener = {
+  export_created,
+  export_failed
+};
+
+/* Re-exports the storage behind an EGLImage as dmabufs and asks the
+   parent compositor to wrap them in a wl_buffer. The request is checked
+   asynchronously, create_immed would make a refusal a fatal error of
+   the whole GDK connection */
+struct PassthroughExport *
+passthrough_export_buffer (struct Passthrough *p, EGLImageKHR image,
+                           int width, int height,
+                           PassthroughExportFunc func, void *data)
+{
+  struct Display *d = p->display;
+  struct PassthroughExport *export;
+  EGLuint64KHR modifiers[MAX_PLANES];
+  EGLint strides[MAX_PLANES], offsets[MAX_PLANES];
+  int fds[MAX_PLANES];
+  int fourcc, n_planes, i;
+
+  if (!export_query (d->egl_display, image, &fourcc, &n_planes, modifiers) ||
+      n_planes < 1 || n_planes > MAX_PLANES)
+    return NULL;
+
+  if (!export_image (d->egl_display, image, fds, strides, offsets))
+    return NULL;
+
+  export = g_new0 (struct PassthroughExport, 1);
+  export->compositor = p->compositor;
+  export->func = func;
+  export->data = data;
+
+  export->params = zwp_linux_dmabuf_v1_create_params (d->dmabuf);
+  zwp_linux_buffer_params_v1_add_listener (export->params, &export_listener,
+                                           export);
+  for (i = 0; i < n_planes; i++)
+    zwp_linux_buffer_params_v1_add (export->params, fds[i], i,
+                                    offsets[i], strides[i],
+                                    modifiers[i] >> 32,
+                                    modifiers[i] & 0xffffffff);
+
+  zwp_linux_buffer_params_v1_create (export->params, width, height, fourcc, 0);
+  wl_display_flush (d->wl_display);
+
+  /* the requests have their own copy of the descriptors */
+  for (i = 0; i < n_planes; i++)
+    close (fds[i]);
+
+  return export;
+}
+
+void
+passthrough_export_cancel (struct PassthroughExport *export)
+{
+  export->func = NULL;
+  export->data = NULL;
+}
+
+/* Damage is in surface coordinates, scale is the buffer scale the client
+   rendered at, the window scale factor for HiDPI aware clients */
+void
+passthrough_attach (struct Passthrough *p, struct wl_buffer *buffer,
+                    int scale, pixman_region32_t *damage)
+{
+  pixman_box32_t *rects;
+  int i, n_rects;
+
+  wl_surface_attach (p->surface, buffer, 0, 0);
+
+  if (scale != p->scale) {
+    wl_surface_set_buffer_scale (p->surface, scale);
+    p->scale = scale;
+    p->mapped = FALSE;
+  }
+
+  if (!p->mapped) {
+    wl_surface_damage (p->surface, 0, 0, G_MAXINT32, G_MAXINT32);
+  } else {
+    rects = pixman_region32_rectangles (damage, &n_rects);
+    for (i = 0; i < n_rects; i++)
+      wl_surface_damage (p->surface, rects[i].x1, rects[i].y1,
+                         rects[i].x2 - rects[i].x1, rects[i].y2 - rects[i].y1);
+  }
+
+  wl_surface_commit (p->surface);
+  wl_display_flush (p->display->wl_display);
+  p->mapped = TRUE;
+}
+
+void
+passthrough_hide (struct Passthrough *p)
+{
+  if (!p->mapped)
+    return;
+
+  wl_surface_attach (p->surface, NULL, 0, 0);
+  wl_surface_commit (p->surface);
+  wl_display_flush (p->display->wl_display);
+  p->mapped = FALSE;
+}
@@ -0,0 +1,42 @@
+#ifndef __PASSTHROUGH_H__
+#define __PASSTHROUGH_H__
+
+#include "compositor.h"
+
+/* Subsurface of the toplevel that client buffers are forwarded to, so
+   that the parent compositor shows them without us compositing them */
+struct Passthrough;
+
+/* Export of a buffer to the parent compositor. func is called with the
+   compositor locked once the parent created its wl_buffer, or with NULL
+   when it refused the dmabufs. Exports are cancelled with the compositor
+   locked too, func isn't called for them then */
+struct PassthroughExport;
+
+typedef void (*PassthroughExportFunc) (struct wl_buffer *buffer, void *data);
+
+struct Passthrough *passthrough_create        (struct Compositor *compositor,
+                                               GdkWindow *window);
+
+void                passthrough_destroy       (struct Passthrough *passthrough);
+
+void                passthrough_set_position  (struct Passthrough *passthrough,
+                                               int x, int y);
+
+struct PassthroughExport *
+                    passthrough_export_buffer (struct Passthrough *passthrough,
+                                               EGLImageKHR image,
+                                               int width, int height,
+                                               PassthroughExportFunc func,
+                                               void *data);
+
+void                passthrough_export_cancel (struct PassthroughExport *export);
+
+void                passthrough_attach        (struct Passthrough *passthrough,
+                                               struct wl_buffer *buffer,
+                                               int scale,
+                                               pixman_region32_t *damage);
+
+void                passthrough_hide          (struct Passthrough *passthrough);
+
+#endif
@@ -0,0 +1,219 @@
+#include "timing.h"
+#include "log.h"
+
+#include <glib-unix.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* Number of events kept, older ones are overwritten */
+#define RING_SIZE 8192
+
+struct TimingRecord {
+  /* index of the write that filled the record plus one, set last so
+     that readers can skip records being written */
+  gint seq;
+  enum TimingEvent event;
+  int tid;
+  gint64 start;
+  /* -1 for marks */
+  gint64 duration;
+};
+
+gboolean timing_enabled;
+
+static struct TimingRecord ring[RING_SIZE];
+static gint ring_head;
+
+static const char *event_names[TIMING_N_EVENTS] = {
+  "attach",
+  "commit",
+  "import",
+  "draw",
+  "frame-done",
+  "release",
+  "buffer-hold"
+};
+
+static int
+current_tid (void)
+{
+  static __thread int tid;
+
+  if (!tid)
+    tid = syscall (SYS_gettid);
+  return tid;
+}
+
+/* Writers only contend on the head index, a record is claimed with a
+   single atomic add and never locked */
+static void
+timing_record (enum TimingEvent event, gint64 start, gint64 duration)
+{
+  guint index = (guint) g_atomic_int_add (&ring_head, 1);
+  struct TimingRecord *record = &ring[index % RING_SIZE];
+
+  g_atomic_int_set (&record->seq, 0);
+  record->event = event;
+  record->tid = current_tid ();
+  record->start = start;
+  record->duration = duration;
+  g_atomic_int_set (&record->seq, (gint) (index + 1));
+}
+
+void
+timing_end (enum TimingEvent event, gint64 start)
+{
+  if (!timing_enabled || !start)
+    return;
+
+  timing_record (event, start, g_get_monotonic_time () - start);
+}
+
+void
+timing_mark (enum TimingEvent event)
+{
+  if (!timing_enabled)
+    return;
+
+  timing_record (event, g_get_monotonic_time (), -1);
+}
+
+static int
+compare_durations (const void *a, const void *b)
+{
+  gint64 da = *(const gint64 *) a, db = *(const gint64 *) b;
+
+  return da < db ? -1 : da > db;
+}
+
+/* Copies the complete records out of the ring, oldest first */
+static guint
+timing_snapshot (struct TimingRecord *records)
+{
+  guint head = (guint) g_atomic_int_get (&ring_head);
+  guint first = head > RING_SIZE ? head - RING_SIZE : 0;
+  guint i, n = 0;
+
+  for (i = first; i < head; i++) {
+    struct TimingRecord *record = &ring[i % RING_SIZE];
+
+    records[n] = *record;
+    if ((guint) g_atomic_int_get (&record->seq) == i + 1 &&
+        (guint) records[n].seq == i + 1)
+      n++;
+  }
+
+  return n;
+}
+
+static void
+print_percentiles (struct TimingRecord *records, guint n_records)
+{
+  gint64 *durations = g_new (gint64, n_records);
+  guint i, n;
+  int event;
+
+  g_print ("timing: %-12s %8s %10s %10s %10s\n",
+           "event", "count", "p50 (us)", "p95 (us)", "p99 (us)");
+
+  for (event = 0; event < TIMING_N_EVENTS; event++) {
+    n = 0;
+    for (i = 0; i < n_records; i++)
+      if (records[i].event == event && records[i].duration >= 0)
+        durations[n++] = records[i].duration;
+
+    if (n == 0)
+      continue;
+
+    qsort (durations, n, sizeof (gint64), compare_durations);
+    g_print ("timing: %-12s %8u %10" G_GINT64_FORMAT " %10" G_GINT64_FORMAT
+             " %10" G_GINT64_FORMAT "\n",
+             event_names[event], n,
+             durations[n * 50 / 100], durations[n * 95 / 100],
+             durations[n * 99 / 100]);
+  }
+
+  g_free (durations);
+}
+
+/* Trace Event Format, loadable in chrome://tracing or Perfetto */
+static gboolean
+write_chrome_trace (const char *path,
+                    struct TimingRecord *records, guint n_records)
+{
+  FILE *f = fopen (path, "w");
+  int pid = getpid ();
+  guint i;
+
+  if (!f)
+    return FALSE;
+
+  fprintf (f, "{\"traceEvents\":[\n");
+  for (i = 0; i < n_records; i++) {
+    struct TimingRecord *record = &records[i];
+
+    if (record->duration >= 0)
+      fprintf (f, "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%" G_GINT64_FORMAT
+               ",\"dur\":%" G_GINT64_FORMAT ",\"pid\":%d,\"tid\":%d}%s\n",
+               event_names[record->event], record->start, record->duration,
+               pid, record->tid, i + 1 < n_records ? "," : "");
+    else
+      fprintf (f, "{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%" G_GINT64_FORMAT
+               ",\"pid\":%d,\"tid\":%d}%s\n",
+               event_names[record->event], record->start,
+               pid, record->tid, i + 1 < n_records ? "," : "");
+  }
+  fprintf (f, "],\"displayTimeUnit\":\"ms\"}\n");
+
+  return fclose (f) == 0;
+}
+
+void
+timing_dump (const char *path)
+{
+  struct TimingRecord *records = g_new (struct TimingRecord, RING_SIZE);
+  guint n_records = timing_snapshot (records);
+
+  print_percentiles (records, n_records);
+
+  if (write_chrome_trace (path, records, n_records))
+    log_info (LOG_TIMING, "wrote %u events to %s", n_records, path);
+  else
+    log_error (LOG_TIMING, "failed to write %s: %s", path, g_strerror (errno));
+
+  g_free (records);
+}
+
+static gboolean
+timing_signal_handler (gpointer data)
+{
+  timing_dump (data);
+  return G_SOURCE_CONTINUE;
+}
+
+/* Recording is off unless NESTED_TIMING=1. The trace goes to
+   NESTED_TIMING_TRACE, or a file in the temporary directory named
+   after the pid, when the process gets SIGUSR1 */
+void
+timing_init (void)
+{
+  char *path;
+
+  if (g_strcmp0 (g_getenv ("NESTED_TIMING"), "1") != 0)
+    return;
+
+  if (g_getenv ("NESTED_TIMING_TRACE"))
+    path = g_strdup (g_getenv ("NESTED_TIMING_TRACE"));
+  else
+    path = g_strdup_printf ("%s/nested-trace-%d.json",
+                            g_get_tmp_dir (), getpid ());
+
+  timing_enabled = TRUE;
+  g_unix_signal_add (SIGUSR1, timing_signal_handler, path);
+
+  log_info (LOG_TIMING, "enabled, SIGUSR1 writes the trace to %s", path);
+}
@@ -0,0 +1,40 @@
+#ifndef __TIMING_H__
+#define __TIMING_H__
+
+#include <glib.h>
+
+/* Steps of the compositor pipeline whose timing gets recorded */
+enum TimingEvent {
+  TIMING_ATTACH,
+  TIMING_COMMIT,
+  TIMING_IMPORT,
+  TIMING_DRAW,
+  TIMING_FRAME_DONE,
+  TIMING_RELEASE,
+  TIMING_HOLD,
+  TIMING_N_EVENTS
+};
+
+/* Set by timing_init () when NESTED_TIMING=1, so that call sites pay
+   a single branch when timing is off */
+extern gboolean timing_enabled;
+
+void   timing_init  (void);
+
+/* Start of a span, to be passed to timing_end () */
+static inline gint64
+timing_begin (void)
+{
+  return timing_enabled ? g_get_monotonic_time () : 0;
+}
+
+void   timing_end   (enum TimingEvent event, gint64 start);
+
+/* Records an event that has no duration, left out of the percentiles */
+void   timing_mark  (enum TimingEvent event);
+
+/* Prints the p50/p95/p99 of every event and writes the recorded events
+   as a Chrome trace to path */
+void   timing_dump  (const char *path);
+
+#endif
@@ -1,17 +1,63 @@
 #include "wl-event-source.h"
+#include "log.h"
 
 #include <wayland-server.h>
 #include <gdk/gdk.h>
+#include <poll.h>
+#include <stdlib.h>
+
+/* Default budget of a dispatch: how many rounds of client requests and
+   how much time it can take before giving the main loop back */
+#define DEFAULT_MAX_ROUNDS 16
+#define DEFAULT_MAX_TIME_US 2000
+
+#define STATS_INTERVAL_US (5 * G_USEC_PER_SEC)
 
 typedef struct _WaylandEventSource {
   GSource source;
   GPollFD pfd;
   struct wl_display *display;
+  GMutex *lock;
+
+  int max_rounds;
+  gint64 max_time;
+
+  /* client events are flushed once per main loop iteration */
+  gboolean needs_flush;
+
+  /* counters, reported every STATS_INTERVAL_US when asked to */
+  gboolean report_stats;
+  gint64 stats_time;
+  guint n_dispatches;
+  guint n_rounds;
+  guint n_budget_hits;
+  guint n_flushes;
 } WaylandEventSource;
 
+struct DisplayThread {
+  GThread *thread;
+  GMainContext *context;
+  GMainLoop *loop;
+};
+
 static gboolean
 g_wl_event_source_prepare (GSource *base, gint *timeout)
 {
+  WaylandEventSource *source = (WaylandEventSource *) base;
+
+  /* whatever the dispatches of this iteration queued goes out in one go
+     before the main loop sleeps */
+  if (source->needs_flush) {
+    if (source->lock)
+      g_mutex_lock (source->lock);
+    wl_display_flush_clients (source->display);
+    if (source->lock)
+      g_mutex_unlock (source->lock);
+
+    source->needs_flush = FALSE;
+    source->n_flushes++;
+  }
+
   *timeout = -1;
   return FALSE;
 }
@@ -23,24 +69,88 @@ g_wl_event_source_check(GSource *base)
   return source->pfd.revents;
 }
 
+static gboolean
+event_loop_has_events (int fd)
+{
+  struct pollfd pfd = { fd, POLLIN, 0 };
+
+  return poll (&pfd, 1, 0) > 0 && (pfd.revents & POLLIN);
+}
+
+static void
+report_stats (WaylandEventSource *source, gint64 now)
+{
+  if (!source->stats_time) {
+    source->stats_time = now;
+    return;
+  }
+
+  if (now - source->stats_time < STATS_INTERVAL_US)
+    return;
+
+  log_info (LOG_DISPATCH, "dispatches: %u, rounds: %u, budget hits: %u, flushes: %u",
+           source->n_dispatches, source->n_rounds,
+           source->n_budget_hits, source->n_flushes);
+
+  source->stats_time = now;
+  source->n_dispatches = 0;
+  source->n_rounds = 0;
+  source->n_budget_hits = 0;
+  source->n_flushes = 0;
+}
+
+/* Dispatches rounds of client requests for as long as there are some
+   and the budget allows. Leftover requests keep the fd readable, so
+   they are picked up in the next main loop iteration, after GTK had its
+   turn */
+static void
+dispatch_with_budget (WaylandEventSource *source)
+{
+  struct wl_event_loop *loop = wl_display_get_event_loop (source->display);
+  gint64 start = g_get_monotonic_time ();
+  gint64 now = start;
+  int rounds = 0;
+
+  do {
+    if (source->lock)
+      g_mutex_lock (source->lock);
+    wl_event_loop_dispatch (loop, 0);
+    if (source->lock)
+      g_mutex_unlock (source->lock);
+
+    rounds++;
+    now = g_get_monotonic_time ();
+  } while (rounds < source->max_rounds &&
+           now - start < source->max_time &&
+           event_loop_has_events (source->pfd.fd));
+
+  if ((rounds == source->max_rounds || now - start >= source->max_time) &&
+      event_loop_has_events (source->pfd.fd))
+    source->n_budget_hits++;
+
+  source->n_dispatches++;
+  source->n_rounds += rounds;
+  source->needs_flush = TRUE;
+
+  if (source->report_stats)
+    report_stats (source, now);
+}
+
 static gboolean
 g_wl_event_source_dispatch(GSource *base,
                            GSourceFunc callback,
                            gpointer data)
 {
   WaylandEventSource *source = (WaylandEventSource *) base;
-  struct wl_display *display = source->display;
-  struct wl_event_loop *loop;
 
   if (source->pfd.revents & G_IO_IN) {
-    loop = wl_display_get_event_loop (display);
-    wl_event_loop_dispatch (loop, -1);
-    wl_display_flush_clients (display);
+    dispatch_with_budget (source);
     source->pfd.revents = 0;
   }
 
   if (source->pfd.revents & (G_IO_ERR | G_IO_HUP)) {
-    g_error ("Lost connection to wayland compositor");
+    log_error (LOG_DISPATCH, "Lost connection to wayland compositor");
+    abort ();
   }
 
   return TRUE;
@@ -59,8 +169,9 @@ static GSourceFuncs wl_glib_source_funcs = {
   g_wl_event_source_finalize
 };
 
-GSource *
-compositor_display_source_new (struct wl_display *display)
+static GSource *
+display_source_new (struct wl_display *display,
+                    GMainContext *context, GMutex *lock)
 {
   GSource *source;
   WaylandEventSource *wl_source;
@@ -74,6 +185,17 @@ compositor_display_source_new (struct wl_display *display)
   wl_source = (WaylandEventSource *) source;
 
   wl_source->display = display;
+  wl_source->lock = lock;
+
+  wl_source->max_rounds = DEFAULT_MAX_ROUNDS;
+  if (g_getenv ("NESTED_DISPATCH_MAX_ROUNDS"))
+    wl_source->max_rounds = MAX (atoi (g_getenv ("NESTED_DISPATCH_MAX_ROUNDS")), 1);
+  wl_source->max_time = DEFAULT_MAX_TIME_US;
+  if (g_getenv ("NESTED_DISPATCH_MAX_US"))
+    wl_source->max_time = MAX (atoi (g_getenv ("NESTED_DISPATCH_MAX_US")), 1);
+  wl_source->report_stats =
+    g_strcmp0 (g_getenv ("NESTED_DISPATCH_STATS"), "1") == 0;
+
   loop = wl_display_get_event_loop (display);
   wl_source->pfd.fd = wl_event_loop_get_fd (loop);
   wl_source->pfd.events = G_IO_IN | G_IO_ERR | G_IO_HUP;
@@ -81,9 +203,54 @@ compositor_display_source_new (struct wl_display *display)
 
   g_source_set_priority (source, GDK_PRIORITY_EVENTS);
   g_source_set_can_recurse (source, TRUE);
-  g_source_attach (source, NULL);
+  g_source_attach (source, context);
 
-  printf ("server: child display fd: %d\n", wl_source->pfd.fd);
+  log_info (LOG_DISPATCH, "child display fd: %d", wl_source->pfd.fd);
 
   return source;
 }
+
+GSource *
+compositor_display_source_new (struct wl_display *display)
+{
+  return display_source_new (display, NULL, NULL);
+}
+
+static gpointer
+display_thread_run (gpointer data)
+{
+  struct DisplayThread *thread = data;
+
+  g_main_context_push_thread_default (thread->context);
+  g_main_loop_run (thread->loop);
+  g_main_context_pop_thread_default (thread->context);
+
+  return NULL;
+}
+
+/* Dispatches the display from a thread of its own, so that requests of
+   the clients don't wait for GTK to be done with layout and painting.
+   Dispatching happens with the lock held: other threads take it before
+   touching the display or the state its handlers change */
+struct DisplayThread *
+compositor_display_thread_new (struct wl_display *display, GMutex *lock)
+{
+  struct DisplayThread *thread = g_new0 (struct DisplayThread, 1);
+  GSource *source;
+
+  thread->context = g_main_context_new ();
+  thread->loop = g_main_loop_new (thread->context, FALSE);
+
+  source = display_source_new (display, thread->context, lock);
+  g_source_unref (source);
+
+  thread->thread = g_thread_new ("nested-display", display_thread_run, thread);
+
+  return thread;
+}
+
+gboolean
+compositor_display_thread_is_current (struct DisplayThread *thread)
+{
+  return thread && g_thread_self () == thread->thread;
+}
@@ -4,6 +4,13 @@
 #include <wayland-client.h>
 #include <glib.h>
 
+struct DisplayThread;
+
 GSource *compositor_display_source_new (struct wl_display *display);
 
+struct DisplayThread *compositor_display_thread_new (struct wl_display *display,
+                                                     GMutex *lock);
+
+gboolean compositor_display_thread_is_current (struct DisplayThread *thread);
+
 #endif